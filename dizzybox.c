@@ -16,17 +16,32 @@ You should have received a copy of the GNU General Public License
 along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
-#define _POSIX_C_SOURCE 200112L
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <grp.h>
+#include <poll.h>
 #include <pwd.h>
+#include <sched.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <sysexits.h>
+#include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
 #ifndef VERSION
@@ -34,27 +49,68 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #endif
 
 #define ENTRYPOINT "/usr/bin/entrypoint"
+#define TMPFS_CACHES_MAX 8
+
+// Entrypoint socket that sessions are handed over to
+#define SESSION_CONTROL "/run/dizzybox/sessions.sock"
+#define SESSIONS_MAX 16
+#define SESSION_CLIENTS_MAX 4
+#define SCROLLBACK_SIZE (64 * 1024)
+#define SESSION_INPUT_SIZE (16 * 1024) // Input not yet taken by the pty
+#define SESSION_MESSAGE_MAX 4097
+#define DETACH_KEY 0x1d // Ctrl-]
+
+#define LOG_SIZE (1024 * 1024)
+#define LOG_SOURCES_MAX 8
+#define LOG_LINE_MAX 1024
+
+// Containers and imported images made by dizzybox create are labelled so
+// that du and gc can find them without touching anything else. Images from
+// archives are also tagged localhost/dizzybox-CONTAINER, since loaded images
+// can't be labelled.
+#define MANAGED_LABEL "dizzybox.managed=true"
+#define MANAGED_MAX 256
+#define GC_JOBS 4
 
 enum Subcommand {
+  subcommandAutostart,
+  subcommandCache,
   subcommandCreate,
+  subcommandDiskUsage,
   subcommandEnter,
   subcommandEntrypoint,
   subcommandExport,
+  subcommandGarbageCollect,
   subcommandHelp,
+  subcommandLogs,
   subcommandRemove,
+  subcommandResume,
   subcommandStart,
+  subcommandSuspend,
   subcommandUpgrade,
 };
 
 struct Flags {
   char *container;
   char *manager; // Container manager
+  char *runtime; // OCI runtime used instead of the manager, if any
   char *image;
+  char *imageArchive;
+  char *rootfs;
   char *fakeHome;
+  char *session;
+  char *after; // Container to start autostarted containers after
+  char *tmpfsCaches[TMPFS_CACHES_MAX];
+  int tmpfsCacheCount;
   char **argv;
   int argc;
   enum Subcommand subcommand;
-  bool dryRun, su, shell;
+  int pruneDays;  // -1 when not pruning
+  int maxAgeDays; // -1 when not removing containers by age
+  int idleDays;   // -1 when not removing containers by last use
+  unsigned long long maxSize; // 0 when not limiting the size
+  bool dryRun, su, shell, sharedCache, homeOverlay, detach;
+  bool socketActivation, removeUnits, follow;
 };
 
 char *defaultCommand[] = {ENTRYPOINT, "-l", 0};
@@ -72,6 +128,9 @@ const struct Flags defaultFlags = {
     .subcommand = subcommandHelp,
     .dryRun = false,
     .su = false,
+    .pruneDays = -1,
+    .maxAgeDays = -1,
+    .idleDays = -1,
 };
 
 void *checkedMalloc(size_t size) {
@@ -97,12 +156,38 @@ Usage: [global options] dizzybox COMMAND [command options]\n\
 Commands:\n\
   create CONTAINER          Create the specified container.\n\
     --image IMAGE           Specify the image to use\n\
+    --image-archive FILE    Import the image from a tarball (xz, zstd, gz)\n\
+    --runtime RUNTIME       Run with an OCI runtime (crun, runc) directly\n\
+    --rootfs DIR            Use an unpacked rootfs with --runtime\n\
+    --shared-cache          Share the package cache with similar containers\n\
+    --fake-home DIR         Use DIR as the home directory in the container\n\
+    --home-overlay          Overlay the real home, with changes kept in DIR\n\
+    --tmpfs-cache PATH[:SIZE]\n\
+                            Keep PATH in memory (repeatable, default 1g)\n\
   enter  CONTAINER          Enter the specified container.\n\
     -s, --su                Become root in the container\n\
+    --attach SESSION        Attach to or start a persistent session\n\
+    --detach                Leave the session running in the background\n\
   rm                        Remove a container\n\
+  suspend CONTAINER         Checkpoint a container to disk and stop it\n\
+  resume CONTAINER          Restore a suspended container\n\
+  logs CONTAINER            Show output of the container's hooks\n\
+    -f, --follow            Keep showing new output\n\
   export ...ENTRIES         Export desktop entries to the host\n\
     --shell                 Make entries start using the login shell\n\
   upgrade CONTAINER         Upgrade the entrypoint of the specified container\n\
+  autostart ...CONTAINERS   Start containers at login, in the order given\n\
+    --socket                Start them on first use of a socket instead\n\
+    --after CONTAINER       Start them after another autostarted container\n\
+    --remove                Stop starting them automatically\n\
+  cache                     Show the size of the shared package caches\n\
+    --prune DAYS            Remove packages unused for DAYS days\n\
+  du                        Show the disk usage of containers and images\n\
+  gc                        Remove stale desktop entries and state\n\
+    --max-age DAYS          Remove containers created DAYS days ago\n\
+    --idle DAYS             Remove containers not entered for DAYS days\n\
+    --max-size SIZE[K|M|G]  Remove the least recently entered containers\n\
+                            until containers and images fit in SIZE\n\
   help                      Show this help message\n\
 \n\
 Global Options:\n\
@@ -119,10 +204,24 @@ int parseSubcommand(char *p, enum Subcommand *sc) {
     *sc = subcommandCreate;
   } else if (!strcmp(p, "rm")) {
     *sc = subcommandRemove;
+  } else if (!strcmp(p, "suspend")) {
+    *sc = subcommandSuspend;
+  } else if (!strcmp(p, "resume")) {
+    *sc = subcommandResume;
+  } else if (!strcmp(p, "logs")) {
+    *sc = subcommandLogs;
   } else if (!strcmp(p, "upgrade")) {
     *sc = subcommandUpgrade;
   } else if (!strcmp(p, "export")) {
     *sc = subcommandExport;
+  } else if (!strcmp(p, "autostart")) {
+    *sc = subcommandAutostart;
+  } else if (!strcmp(p, "cache")) {
+    *sc = subcommandCache;
+  } else if (!strcmp(p, "du")) {
+    *sc = subcommandDiskUsage;
+  } else if (!strcmp(p, "gc")) {
+    *sc = subcommandGarbageCollect;
   } else if (!strcmp(p, "help")) {
     *sc = subcommandHelp;
   } else {
@@ -131,6 +230,32 @@ int parseSubcommand(char *p, enum Subcommand *sc) {
   return 0;
 }
 
+// Returns -1 if arg is not a number of days
+int parseDays(char *arg) {
+  char *end;
+  long days = strtol(arg, &end, 10);
+  return *end || end == arg || days < 0 || days > 1000000 ? -1 : days;
+}
+
+// Parses a size in bytes with an optional K, M, G or T suffix.
+// Returns 0 if it is invalid.
+unsigned long long parseSize(char *arg) {
+  char *end;
+  unsigned long long size = strtoull(arg, &end, 10);
+  if (end == arg || *arg == '-') {
+    return 0;
+  }
+  static const char suffixes[] = "KMGT";
+  const char *suffix = *end ? strchr(suffixes, *end & ~0x20) : 0;
+  if (*end && (!suffix || end[1])) {
+    return 0;
+  }
+  if (suffix) {
+    size <<= 10 * (suffix - suffixes + 1);
+  }
+  return size;
+}
+
 void unreachable(void) {
   fputs("Unreachable reached", stderr);
   exit(EX_SOFTWARE);
@@ -163,14 +288,21 @@ int parseArgs(int argc, char **argv, struct Flags *flags) {
         case subcommandEnter:
         case subcommandRemove:
         case subcommandStart:
+        case subcommandSuspend:
+        case subcommandResume:
+        case subcommandLogs:
         case subcommandUpgrade:
         case subcommandCreate:
           state = stContainer;
           break;
         case subcommandHelp:
+        case subcommandCache:
+        case subcommandDiskUsage:
+        case subcommandGarbageCollect:
           state = stNoMore;
           break;
         case subcommandExport:
+        case subcommandAutostart:
           state = stArguments;
           break;
         case subcommandEntrypoint:
@@ -202,12 +334,84 @@ int parseArgs(int argc, char **argv, struct Flags *flags) {
             return EX_USAGE;
           }
           flags->image = *argv;
+        } else if (!strcmp(flag, "image-archive")) {
+          if (++argv == end) {
+            fputs("--image-archive used, but no file specified.\n", stderr);
+            return EX_USAGE;
+          }
+          flags->imageArchive = *argv;
+        } else if (!strcmp(flag, "runtime")) {
+          if (++argv == end) {
+            fputs("--runtime used, but no runtime specified.\n", stderr);
+            return EX_USAGE;
+          }
+          flags->runtime = *argv;
+        } else if (!strcmp(flag, "rootfs")) {
+          if (++argv == end) {
+            fputs("--rootfs used, but no directory specified.\n", stderr);
+            return EX_USAGE;
+          }
+          flags->rootfs = *argv;
         } else if (!strcmp(flag, "fake-home")) {
           if (++argv == end) {
             fputs("--fake-home used, but no directory specified.\n", stderr);
             return EX_USAGE;
           }
           flags->fakeHome = *argv;
+        } else if (!strcmp(flag, "home-overlay")) {
+          flags->homeOverlay = true;
+        } else if (!strcmp(flag, "tmpfs-cache")) {
+          if (++argv == end) {
+            fputs("--tmpfs-cache used, but no directory specified.\n", stderr);
+            return EX_USAGE;
+          }
+          if (flags->tmpfsCacheCount == TMPFS_CACHES_MAX) {
+            fputs("Too many tmpfs caches.\n", stderr);
+            return EX_USAGE;
+          }
+          flags->tmpfsCaches[flags->tmpfsCacheCount++] = *argv;
+        } else if (!strcmp(flag, "shared-cache")) {
+          flags->sharedCache = true;
+        } else if (!strcmp(flag, "prune")) {
+          if (++argv == end || (flags->pruneDays = parseDays(*argv)) < 0) {
+            fputs("--prune needs a number of days.\n", stderr);
+            return EX_USAGE;
+          }
+        } else if (!strcmp(flag, "max-age")) {
+          if (++argv == end || (flags->maxAgeDays = parseDays(*argv)) < 0) {
+            fputs("--max-age needs a number of days.\n", stderr);
+            return EX_USAGE;
+          }
+        } else if (!strcmp(flag, "idle")) {
+          if (++argv == end || (flags->idleDays = parseDays(*argv)) < 0) {
+            fputs("--idle needs a number of days.\n", stderr);
+            return EX_USAGE;
+          }
+        } else if (!strcmp(flag, "max-size")) {
+          if (++argv == end || !(flags->maxSize = parseSize(*argv))) {
+            fputs("--max-size needs a size, such as 20G.\n", stderr);
+            return EX_USAGE;
+          }
+        } else if (!strcmp(flag, "attach")) {
+          if (++argv == end) {
+            fputs("--attach used, but no session specified.\n", stderr);
+            return EX_USAGE;
+          }
+          flags->session = *argv;
+        } else if (!strcmp(flag, "detach")) {
+          flags->detach = true;
+        } else if (!strcmp(flag, "socket")) {
+          flags->socketActivation = true;
+        } else if (!strcmp(flag, "remove")) {
+          flags->removeUnits = true;
+        } else if (!strcmp(flag, "after")) {
+          if (++argv == end) {
+            fputs("--after used, but no container specified.\n", stderr);
+            return EX_USAGE;
+          }
+          flags->after = *argv;
+        } else if (!strcmp(flag, "follow")) {
+          flags->follow = true;
         } else if (!strcmp(flag, "shell")) {
           flags->shell = true;
         } else {
@@ -228,6 +432,9 @@ int parseArgs(int argc, char **argv, struct Flags *flags) {
         case 'd':
           flags->dryRun = true;
           break;
+        case 'f':
+          flags->follow = true;
+          break;
         }
       }
     } else { // Positional
@@ -249,14 +456,21 @@ int parseArgs(int argc, char **argv, struct Flags *flags) {
         case subcommandEnter:
         case subcommandRemove:
         case subcommandStart:
+        case subcommandSuspend:
+        case subcommandResume:
+        case subcommandLogs:
         case subcommandUpgrade:
         case subcommandCreate:
           state = stContainer;
           break;
         case subcommandHelp:
+        case subcommandCache:
+        case subcommandDiskUsage:
+        case subcommandGarbageCollect:
           state = stNoMore;
           break;
         case subcommandExport:
+        case subcommandAutostart:
           state = stArguments;
           break;
         case subcommandEntrypoint:
@@ -317,442 +531,3858 @@ char *mountString(char *mountpoint) {
   return mem;
 }
 
-// Sets up /usr/bin/entrypoint in the container.
-int installEntrypoint(struct Flags flags) {
-  // Find dizzybox's executable path
-  char *self;
-  for (int selfCap = 1024;; selfCap *= 2) {
-    self = checkedMalloc(sizeof(char) * selfCap);
-    int selfLen = readlink("/proc/self/exe", self, selfCap);
-    if (selfLen < 0) {
-      fputs("Error: Could not determine path to self.\n", stderr);
-      return EX_SOFTWARE;
-    }
-
-    if (selfLen < selfCap) {
-      break;
-    }
-
-    free(self);
+// Concatenates strings up to a null pointer.
+// Returned pointer must be freed
+char *concat(char *first, ...) {
+  va_list args;
+  size_t len = 0;
+  va_start(args, first);
+  for (char *p = first; p; p = va_arg(args, char *)) {
+    len += strlen(p);
   }
+  va_end(args);
 
-  // Copy ourself as the entrypoint
-  int nameLen = strlen(flags.container);
-  char *cpTarget =
-      checkedMalloc(sizeof(char) * nameLen + sizeof(":" ENTRYPOINT));
-  strcpy(cpTarget, flags.container);
-  strcpy(cpTarget + nameLen, ":" ENTRYPOINT);
-
-  char *argv2[] = {flags.manager, "cp", self, cpTarget, 0};
-  int exitCode = runCommand(flags, argv2);
-
-  free(cpTarget);
-
-  if (exitCode) {
-    fprintf(stderr,
-            "Failed to set up container entrypoint. Calling dizzybox upgrade "
-            "%s may be able to fix it.\n",
-            flags.container);
-    return EX_OSERR;
-  };
-
-  return 0;
+  char *mem = checkedMalloc(sizeof(char) * (len + 1));
+  char *tail = mem;
+  va_start(args, first);
+  for (char *p = first; p; p = va_arg(args, char *)) {
+    size_t pLen = strlen(p);
+    memcpy(tail, p, pLen);
+    tail += pLen;
+  }
+  va_end(args);
+  *tail = 0;
+  return mem;
 }
 
-int containerCreate(struct Flags flags) {
+// Returns the user's home directory. In podman unshare, where the user is
+// root, it is passed on by unshareSelf.
+char *userHome(void) {
+  char *home = getenv("_DIZZYBOX_HOME");
+  if (home) {
+    return home;
+  }
+
   struct passwd *pwuid = getpwuid(getuid());
   if (!pwuid) {
     fputs("Failed to get user home information.\n", stderr);
-    return EX_CONFIG;
+    exit(EX_CONFIG);
+  }
+  return pwuid->pw_dir;
+}
+
+// Returns a path inside dizzybox's data directory.
+// Returned pointer must be freed
+char *dataPath(char *relPath) {
+  char *dataHome = getenv("XDG_DATA_HOME");
+  if (dataHome && *dataHome) {
+    return concat(dataHome, "/dizzybox/", relPath, (char *)0);
   }
-  char *homeVolume = mountString(pwuid->pw_dir);
+  return concat(userHome(), "/.local/share/dizzybox/", relPath, (char *)0);
+}
 
+// Returns the path of a container's log, which is passed to the entrypoint
+// through DIZZYBOX_LOG.
+// Returned pointer must be freed
+char *logPath(char *container) {
   char *runtimeDir = getenv("XDG_RUNTIME_DIR");
   if (!runtimeDir) {
     fputs("The XDG_RUNTIME_DIR environment variable must be set!\n", stderr);
-    return EX_CONFIG;
+    return 0;
   }
-  char *runtimeVolume = mountString(runtimeDir);
+  return concat(runtimeDir, "/dizzybox/logs/", container, ".log", (char *)0);
+}
 
-  char *argv[] = {
-      flags.manager,
-      "create",
-      "--privileged",
-      "--net=host",
-      "--user=0:0",
-      "--volume=/run/host:/run/host",
-      "--volume=/tmp:/tmp",
-      "--volume=/dev:/dev",
-      "--mount=type=devpts,destination=/dev/pts",
-      ("--entrypoint=" ENTRYPOINT),
-      "--userns=keep-id",
-      "--volume",
-      homeVolume,
-      "--volume",
-      runtimeVolume,
-      "--name",
-      flags.container,
-      flags.image,
-      0,
-  };
-  int exitCode = runCommand(flags, argv);
-  if (exitCode) {
-    return exitCode;
+// Creates a directory along with any missing parents, like mkdir -p.
+int makeDirs(char *path) {
+  for (char *p = path + 1;; ++p) {
+    if (*p != '/' && *p) {
+      continue;
+    }
+
+    char saved = *p;
+    *p = 0;
+    int err = mkdir(path, 0755) && errno != EEXIST;
+    *p = saved;
+    if (err) {
+      fprintf(stderr, "Failed to create directory %s.\n", path);
+      return EX_CANTCREAT;
+    }
+    if (!saved) {
+      return 0;
+    }
   }
+}
 
-  free(runtimeVolume);
-  free(homeVolume);
+// Returns the exit status of a child, or -1 if it could not be waited on.
+int waitChild(int childPid) {
+  int stat = 0;
+  if (waitpid(childPid, &stat, 0) == -1) {
+    return -1;
+  }
+  return stat;
+}
 
-  exitCode = installEntrypoint(flags);
-  if (exitCode) {
-    return exitCode;
+// Starts a command with its stdin and stdout replaced by the given file
+// descriptors, unless they are -1. Returns the child's PID, or -1.
+int spawnCommand(char *argv[], int input, int output) {
+  int childPid = fork();
+  if (childPid) {
+    return childPid;
   }
 
-  return 0;
+  if (input != -1) {
+    dup2(input, STDIN_FILENO);
+    close(input);
+  }
+  if (output != -1) {
+    dup2(output, STDOUT_FILENO);
+    close(output);
+  }
+  execvp(argv[0], argv);
+  fprintf(stderr, "Failed to run %s.\n", argv[0]);
+  exit(EX_OSERR);
 }
 
-int containerStart(struct Flags flags) {
-  char *argv[] = {flags.manager, "start", flags.container, 0};
-  if (flags.dryRun) {
-    printCommand(argv);
-    return 0;
+// Runs a command, storing up to cap - 1 bytes of its output in out.
+// Unlike runCommand, this is done even on a dry run, since the output is used
+// to decide what to do. Stderr is discarded.
+int captureCommand(char *argv[], char *out, size_t cap) {
+  int output[2];
+  if (pipe(output)) {
+    return EX_OSERR;
   }
 
   int childPid = fork();
-  if (childPid) {
-    int stat;
-    waitpid(childPid, &stat, 0);
-    return stat;
-  } else {
-    int err = execvp(flags.manager, argv);
-    exit(err);
+  if (childPid == -1) {
+    close(output[0]);
+    close(output[1]);
+    return EX_OSERR;
   }
-}
 
-int containerEnter(struct Flags flags) {
-  int result;
+  if (!childPid) {
+    close(output[0]);
+    dup2(output[1], STDOUT_FILENO);
+    int devNull = open("/dev/null", O_WRONLY);
+    dup2(devNull, STDERR_FILENO);
+    execvp(argv[0], argv);
+    exit(EX_OSERR);
+  }
 
-  // strcmp is not used because we want to check if it is manually set
-  if (flags.image != defaultFlags.image) {
-    result = containerCreate(flags);
-    if (result) {
-      return result;
+  close(output[1]);
+  size_t len = 0;
+  for (ssize_t n; (n = read(output[0], out + len, cap - 1 - len)) > 0;) {
+    len += n;
+    if (len == cap - 1) {
+      // Drain the rest so the child does not block
+      char discard[512];
+      while (read(output[0], discard, sizeof(discard)) > 0)
+        ;
+      break;
     }
   }
+  out[len] = 0;
+  close(output[0]);
+  return waitChild(childPid);
+}
 
-  result = containerStart(flags);
-  if (result) {
-    return result;
+// Copies a file, replacing the destination rather than writing into it so
+// that running executables can be upgraded.
+int copyFile(char *source, char *destination, mode_t mode) {
+  int in = open(source, O_RDONLY);
+  if (in == -1) {
+    fprintf(stderr, "Failed to open %s for reading.\n", source);
+    return EX_NOINPUT;
   }
 
-  char *cwd;
-  for (int cwdCap = 1024;; cwdCap *= 2) {
-    cwd = checkedMalloc(sizeof(char) * cwdCap);
-    if (getcwd(cwd, cwdCap)) {
+  unlink(destination);
+  int out = open(destination, O_WRONLY | O_CREAT | O_TRUNC, mode);
+  if (out == -1) {
+    close(in);
+    fprintf(stderr, "Failed to create %s.\n", destination);
+    return EX_CANTCREAT;
+  }
+
+  char buffer[1 << 16];
+  int result = 0;
+  for (ssize_t n; (n = read(in, buffer, sizeof(buffer)));) {
+    if (n < 0 || write(out, buffer, n) != n) {
+      fprintf(stderr, "Failed to copy %s to %s.\n", source, destination);
+      result = EX_IOERR;
       break;
     }
-    free(cwd);
   }
 
-  // TODO: Figure out a more appropriate size
-  const int managerArgsMax = 100;
-  char **argv =
-      checkedMalloc(sizeof(char *) * (flags.argc + managerArgsMax + 1));
+  close(in);
+  close(out);
+  return result;
+}
 
-  int containerLen = strlen(flags.container);
-  char *containerArg = checkedMalloc(sizeof("CONTAINER_ID=") + containerLen);
-  memcpy(containerArg, "CONTAINER_ID=", sizeof("CONTAINER_ID=") - 1);
-  memcpy(containerArg + sizeof("CONTAINER_ID=") - 1, flags.container,
-         containerLen + 1);
+// Finds dizzybox's executable path.
+// Returned pointer must be freed
+char *selfPath(void) {
+  for (int selfCap = 1024;; selfCap *= 2) {
+    char *self = checkedMalloc(sizeof(char) * selfCap);
+    int selfLen = readlink("/proc/self/exe", self, selfCap);
+    if (selfLen < 0) {
+      free(self);
+      return 0;
+    }
 
-  int argc = 0;
-  argv[argc++] = flags.manager;
-  argv[argc++] = "exec";
-  argv[argc++] = "-it";
-  argv[argc++] = "--workdir";
-  argv[argc++] = cwd;
-  argv[argc++] = "--env";
-  argv[argc++] = containerArg;
+    if (selfLen < selfCap) {
+      self[selfLen] = 0;
+      return self;
+    }
 
-  argv[argc++] = "-u";
-  if (flags.su) {
-    argv[argc++] = "root";
-  } else {
-    argv[argc++] = getlogin();
+    free(self);
   }
+}
 
-  // Track all of the strings that are allocated in the loop
-  void *mustFree[sizeof(sharedEnv) / sizeof(*sharedEnv)];
-  void **freeTop = mustFree;
+// Resolves the --fake-home directory, creating it and the directories used
+// by --home-overlay if needed.
+// Returned pointer must be freed
+char *prepareFakeHome(struct Flags flags, char *home) {
+  if (!flags.dryRun && makeDirs(flags.fakeHome)) {
+    return 0;
+  }
 
-  for (char **env = sharedEnv; *env; ++env) {
-    char *envVar = *env;
-    char *value = getenv(envVar);
-    if (value) {
-      size_t envVarLen = strlen(envVar);
-      size_t valueLen = strlen(value);
+  char *fakeHome = realpath(flags.fakeHome, 0);
+  if (!fakeHome) {
+    if (!flags.dryRun) {
+      fprintf(stderr, "The fake home %s could not be found.\n",
+              flags.fakeHome);
+      return 0;
+    }
+    fakeHome = concat(flags.fakeHome, (char *)0);
+  }
 
-      char *envArg = checkedMalloc(sizeof(char) * (envVarLen + valueLen + 2));
-      *freeTop++ = envArg;
+  if (!flags.homeOverlay) {
+    return fakeHome;
+  }
 
-      memcpy(envArg, envVar, envVarLen);
-      envArg[envVarLen] = '=';
-      memcpy(envArg + envVarLen + 1, value, valueLen + 1);
+  // overlayfs refuses an upper directory inside the lower one.
+  size_t homeLen = strlen(home);
+  if (!strncmp(fakeHome, home, homeLen) &&
+      (fakeHome[homeLen] == '/' || !fakeHome[homeLen])) {
+    fprintf(stderr, "The fake home must be outside of %s for --home-overlay.\n",
+            home);
+    free(fakeHome);
+    return 0;
+  }
 
-      argv[argc++] = "-e";
-      argv[argc++] = envArg;
+  char *dirs[] = {concat(fakeHome, "/upper", (char *)0),
+                  concat(fakeHome, "/work", (char *)0)};
+  int err = 0;
+  for (int i = 0; i < 2; ++i) {
+    if (!flags.dryRun && !err) {
+      err = makeDirs(dirs[i]);
     }
+    free(dirs[i]);
   }
+  if (err) {
+    free(fakeHome);
+    return 0;
+  }
+  return fakeHome;
+}
 
-  argv[argc++] = flags.container;
+// Splits a --tmpfs-cache argument of the form PATH[:SIZE], where a relative
+// PATH is inside the home directory.
+// Returned pointer must be freed
+char *tmpfsCachePath(char *spec, char *home, char **size) {
+  char *separator = strrchr(spec, ':');
+  size_t pathLen = separator ? (size_t)(separator - spec) : strlen(spec);
+  *size = separator ? separator + 1 : "1g";
 
-  memcpy(argv + argc, flags.argv, sizeof(char *) * (flags.argc + 1));
-  if (flags.dryRun) {
-    printCommand(argv);
-    result = 0;
+  char *path = checkedMalloc(sizeof(char) * (strlen(home) + pathLen + 2));
+  if (*spec == '/') {
+    *path = 0;
   } else {
-    execvp(argv[0], argv);
+    strcpy(path, home);
+    strcat(path, "/");
+  }
+  strncat(path, spec, pathLen);
+  return path;
+}
 
-    fputs("Failed to exec", stderr);
-    result = EX_OSERR;
+// A range of ids mapped into a user namespace.
+struct IdMap {
+  unsigned long inside, outside, count;
+};
+
+// Builds mappings like podman's --userns=keep-id from a subordinate id file
+// such as /etc/subuid: the id is kept, and the rest come from the
+// subordinate range. Without a range, only the id itself is mapped.
+// Returns the number of mappings.
+int idMappings(char *subidFile, char *user, unsigned long id,
+               struct IdMap maps[3]) {
+  unsigned long start = 0, count = 0;
+  char idString[32];
+  snprintf(idString, sizeof(idString), "%lu", id);
+
+  FILE *file = fopen(subidFile, "r");
+  if (file) {
+    char line[256];
+    while (fgets(line, sizeof(line), file)) {
+      char *separator = strchr(line, ':');
+      if (!separator) {
+        continue;
+      }
+      *separator = 0;
+      if (strcmp(line, user) && strcmp(line, idString)) {
+        continue;
+      }
+      if (sscanf(separator + 1, "%lu:%lu", &start, &count) == 2) {
+        break;
+      }
+      count = 0;
+    }
+    fclose(file);
   }
 
-  while (freeTop-- > mustFree) {
-    free(*freeTop);
+  if (!id || count <= id) {
+    maps[0] = (struct IdMap){id, id, 1};
+    return 1;
   }
-  free(containerArg);
-  free(argv);
-  free(cwd);
 
-  return result;
+  maps[0] = (struct IdMap){0, start, id};
+  maps[1] = (struct IdMap){id, id, 1};
+  maps[2] = (struct IdMap){id + 1, start + id, count - id};
+  return 3;
 }
 
-int containerRemove(struct Flags flags) {
-  char *argv[] = {flags.manager, "rm", flags.container, 0};
-  return execvp(flags.manager, argv);
+// Fills in the uid and gid mappings used by OCI containers.
+// Returns -1 on failure
+int userMappings(struct IdMap uidMaps[3], int *uidCount,
+                 struct IdMap gidMaps[3], int *gidCount) {
+  struct passwd *pwuid = getpwuid(getuid());
+  if (!pwuid) {
+    fputs("Failed to get user information.\n", stderr);
+    return -1;
+  }
+  *uidCount = idMappings("/etc/subuid", pwuid->pw_name, getuid(), uidMaps);
+  *gidCount = idMappings("/etc/subgid", pwuid->pw_name, getgid(), gidMaps);
+  return 0;
 }
 
-// Export a desktop file.
-// Not implemented: XDG_DATA_DIRS, icon
-int exportDesktopEntry(struct Flags flags, char *fileName) {
-  char *containerId = getenv("CONTAINER_ID");
-  if (!containerId) {
-    puts("Failed to get container ID. $CONTAINER_ID must be set.");
+// Applies the user mappings to the user namespace of a process.
+// Returns -1 on failure
+int writeUserMappings(int pid) {
+  struct IdMap uidMaps[3], gidMaps[3];
+  int uidCount, gidCount;
+  if (userMappings(uidMaps, &uidCount, gidMaps, &gidCount)) {
+    return -1;
+  }
+
+  char pidString[32];
+  snprintf(pidString, sizeof(pidString), "%d", pid);
+
+  if (uidCount == 1 && gidCount == 1) {
+    // Mapping our own ids needs no helpers.
+    char path[64], map[64];
+    struct {
+      char *file, *contents;
+    } writes[] = {{"uid_map", map}, {"setgroups", "deny"}, {"gid_map", map}};
+    for (int i = 0; i < 3; ++i) {
+      struct IdMap *m = i ? gidMaps : uidMaps;
+      snprintf(map, sizeof(map), "%lu %lu %lu\n", m->inside, m->outside,
+               m->count);
+      snprintf(path, sizeof(path), "/proc/%d/%s", pid, writes[i].file);
+      int fd = open(path, O_WRONLY);
+      if (fd == -1) {
+        return -1;
+      }
+      int len = strlen(writes[i].contents);
+      int written = write(fd, writes[i].contents, len);
+      close(fd);
+      if (written != len) {
+        return -1;
+      }
+    }
+    return 0;
+  }
+
+  // Otherwise, the setuid helpers from shadow are needed.
+  for (int i = 0; i < 2; ++i) {
+    struct IdMap *maps = i ? gidMaps : uidMaps;
+    int count = i ? gidCount : uidCount;
+    char numbers[3][3][24];
+    char *argv[2 + 3 * 3 + 1] = {i ? "newgidmap" : "newuidmap", pidString};
+    int argc = 2;
+    for (int m = 0; m < count; ++m) {
+      snprintf(numbers[m][0], sizeof(*numbers[m]), "%lu", maps[m].inside);
+      snprintf(numbers[m][1], sizeof(*numbers[m]), "%lu", maps[m].outside);
+      snprintf(numbers[m][2], sizeof(*numbers[m]), "%lu", maps[m].count);
+      for (int n = 0; n < 3; ++n) {
+        argv[argc++] = numbers[m][n];
+      }
+    }
+    argv[argc] = 0;
+
+    int childPid = spawnCommand(argv, -1, -1);
+    if (childPid == -1 || waitChild(childPid)) {
+      fprintf(stderr, "%s failed.\n", argv[0]);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Forks into a new user namespace with the same mappings as OCI containers,
+// so files written by the child get the ownership the container expects.
+// Returns like fork(); the child becomes root in the namespace if mapped.
+int forkUserNamespace(void) {
+  int ready[2], mapped[2];
+  if (pipe(ready)) {
+    return -1;
+  }
+  if (pipe(mapped)) {
+    close(ready[0]);
+    close(ready[1]);
+    return -1;
+  }
+
+  int childPid = fork();
+  if (childPid == -1) {
+    return -1;
+  }
+
+  char status = 0;
+  if (!childPid) {
+    close(ready[0]);
+    close(mapped[1]);
+    status = !unshare(CLONE_NEWUSER);
+    if (write(ready[1], &status, 1) != 1 || !status ||
+        read(mapped[0], &status, 1) != 1 || !status) {
+      fputs("Failed to set up a user namespace.\n", stderr);
+      exit(EX_OSERR);
+    }
+    close(ready[1]);
+    close(mapped[0]);
+
+    // Fails harmlessly if root is not mapped
+    if (!setgid(0)) {
+      setgroups(0, 0);
+    }
+    setuid(0);
+    return 0;
+  }
+
+  close(ready[1]);
+  close(mapped[0]);
+  if (read(ready[0], &status, 1) == 1 && status) {
+    status = !writeUserMappings(childPid);
+  }
+  if (write(mapped[1], &status, 1) != 1) {
+    status = 0;
+  }
+  close(ready[0]);
+  close(mapped[1]);
+
+  if (!status) {
+    waitChild(childPid);
+    return -1;
+  }
+  return childPid;
+}
+
+// Returns the bundle directory of an OCI container.
+// Returned pointer must be freed
+char *ociBundlePath(char *container) {
+  char *relPath = concat("oci/", container, (char *)0);
+  char *bundle = dataPath(relPath);
+  free(relPath);
+  return bundle;
+}
+
+// Returns the OCI runtime a container was created with, or null if it is
+// managed by the container manager.
+// Returned pointer must be freed
+char *ociRuntime(char *container) {
+  char *bundle = ociBundlePath(container);
+  char *runtimePath = concat(bundle, "/runtime", (char *)0);
+  free(bundle);
+
+  FILE *file = fopen(runtimePath, "r");
+  free(runtimePath);
+  if (!file) {
+    return 0;
+  }
+
+  char line[256];
+  char *runtime = 0;
+  if (fgets(line, sizeof(line), file)) {
+    line[strcspn(line, "\n")] = 0;
+    runtime = concat(line, (char *)0);
+  }
+  fclose(file);
+  return runtime;
+}
+
+// Writes a string as a JSON string literal.
+void jsonString(FILE *out, char *string) {
+  fputc('"', out);
+  for (unsigned char *p = (unsigned char *)string; *p; ++p) {
+    if (*p == '"' || *p == '\\') {
+      fputc('\\', out);
+      fputc(*p, out);
+    } else if (*p < 0x20) {
+      fprintf(out, "\\u%04x", *p);
+    } else {
+      fputc(*p, out);
+    }
+  }
+  fputc('"', out);
+}
+
+void jsonIdMappings(FILE *out, struct IdMap *maps, int count) {
+  fputc('[', out);
+  for (int i = 0; i < count; ++i) {
+    fprintf(out, "%s{\"containerID\": %lu, \"hostID\": %lu, \"size\": %lu}",
+            i ? ", " : "", maps[i].inside, maps[i].outside, maps[i].count);
+  }
+  fputc(']', out);
+}
+
+// Writes a bind mount to an OCI config, with the same path on both sides.
+void jsonBindMount(FILE *out, char *path, char *options) {
+  fputs(",\n    {\"destination\": ", out);
+  jsonString(out, path);
+  fputs(", \"type\": \"bind\", \"source\": ", out);
+  jsonString(out, path);
+  fprintf(out, ", \"options\": [%s]}", options);
+}
+
+// Writes an OCI runtime config mirroring the podman options of
+// containerCreate.
+int writeOciConfig(FILE *out, struct Flags flags, char *rootfs) {
+  struct passwd *pwuid = getpwuid(getuid());
+  if (!pwuid) {
+    fputs("Failed to get user home information.\n", stderr);
+    return EX_CONFIG;
+  }
+
+  char *runtimeDir = getenv("XDG_RUNTIME_DIR");
+  if (!runtimeDir) {
+    fputs("The XDG_RUNTIME_DIR environment variable must be set!\n", stderr);
+    return EX_CONFIG;
+  }
+
+  char *fakeHome = 0;
+  if (flags.fakeHome &&
+      !(fakeHome = prepareFakeHome(flags, pwuid->pw_dir))) {
+    return EX_CANTCREAT;
+  }
+
+  struct IdMap uidMaps[3], gidMaps[3];
+  int uidCount, gidCount;
+  if (userMappings(uidMaps, &uidCount, gidMaps, &gidCount)) {
+    free(fakeHome);
+    return EX_CONFIG;
+  }
+  // Run as root like --user=0:0 when it is mapped.
+  unsigned long uid = uidMaps[0].inside, gid = gidMaps[0].inside;
+
+  // Everything, as with --privileged
+  static char *const capabilities[] = {
+      "CHOWN",           "DAC_OVERRIDE",     "DAC_READ_SEARCH",
+      "FOWNER",          "FSETID",           "KILL",
+      "SETGID",          "SETUID",           "SETPCAP",
+      "LINUX_IMMUTABLE", "NET_BIND_SERVICE", "NET_BROADCAST",
+      "NET_ADMIN",       "NET_RAW",          "IPC_LOCK",
+      "IPC_OWNER",       "SYS_MODULE",       "SYS_RAWIO",
+      "SYS_CHROOT",      "SYS_PTRACE",       "SYS_PACCT",
+      "SYS_ADMIN",       "SYS_BOOT",         "SYS_NICE",
+      "SYS_RESOURCE",    "SYS_TIME",         "SYS_TTY_CONFIG",
+      "MKNOD",           "LEASE",            "AUDIT_WRITE",
+      "AUDIT_CONTROL",   "SETFCAP",          "MAC_OVERRIDE",
+      "MAC_ADMIN",       "SYSLOG",           "WAKE_ALARM",
+      "BLOCK_SUSPEND",   "AUDIT_READ",       0,
+  };
+  static char *const capabilitySets[] = {"bounding", "effective",
+                                         "inheritable", "permitted", 0};
+
+  fprintf(out, "{\n  \"ociVersion\": \"1.0.2\",\n  \"process\": {\n"
+               "    \"terminal\": false,\n");
+  fprintf(out, "    \"user\": {\"uid\": %lu, \"gid\": %lu},\n", uid, gid);
+  fputs("    \"args\": [\"" ENTRYPOINT "\"],\n"
+        "    \"env\": [\"PATH=/usr/local/sbin:/usr/local/bin:/usr/sbin:"
+        "/usr/bin:/sbin:/bin\", \"container=oci\", ",
+        out);
+  char *log = logPath(flags.container);
+  char *logEnv = concat("DIZZYBOX_LOG=", log, (char *)0);
+  jsonString(out, logEnv);
+  free(logEnv);
+  free(log);
+  fputs("],\n"
+        "    \"cwd\": \"/\",\n"
+        "    \"capabilities\": {",
+        out);
+  for (char *const *set = capabilitySets; *set; ++set) {
+    fprintf(out, "%s\n      \"%s\": [", set == capabilitySets ? "" : ",",
+            *set);
+    for (char *const *cap = capabilities; *cap; ++cap) {
+      fprintf(out, "%s\"CAP_%s\"", cap == capabilities ? "" : ", ", *cap);
+    }
+    fputc(']', out);
+  }
+  fputs("\n    }\n  },\n  \"root\": {\"path\": ", out);
+  jsonString(out, rootfs);
+  fputs(", \"readonly\": false},\n", out);
+
+  fputs("  \"mounts\": [\n"
+        "    {\"destination\": \"/proc\", \"type\": \"proc\", "
+        "\"source\": \"proc\"}",
+        out);
+  jsonBindMount(out, "/dev", "\"rbind\", \"nosuid\"");
+  fputs(",\n    {\"destination\": \"/dev/pts\", \"type\": \"devpts\", "
+        "\"source\": \"devpts\", \"options\": [\"nosuid\", \"noexec\", "
+        "\"newinstance\", \"ptmxmode=0666\", \"mode=0620\"]}",
+        out);
+  jsonBindMount(out, "/sys", "\"rbind\", \"nosuid\", \"noexec\", \"nodev\"");
+  if (!access("/run/host", F_OK)) {
+    jsonBindMount(out, "/run/host", "\"rbind\"");
+  }
+  jsonBindMount(out, "/tmp", "\"rbind\"");
+  jsonBindMount(out, "/etc/resolv.conf", "\"bind\", \"ro\"");
+  jsonBindMount(out, "/etc/hosts", "\"bind\", \"ro\"");
+  if (!fakeHome) {
+    jsonBindMount(out, pwuid->pw_dir, "\"rbind\"");
+  } else if (flags.homeOverlay) {
+    fputs(",\n    {\"destination\": ", out);
+    jsonString(out, pwuid->pw_dir);
+    fputs(", \"type\": \"overlay\", \"source\": \"overlay\", \"options\": [",
+          out);
+    char *options[] = {
+        concat("lowerdir=", pwuid->pw_dir, (char *)0),
+        concat("upperdir=", fakeHome, "/upper", (char *)0),
+        concat("workdir=", fakeHome, "/work", (char *)0),
+    };
+    for (int i = 0; i < 3; ++i) {
+      fputs(i ? ", " : "", out);
+      jsonString(out, options[i]);
+      free(options[i]);
+    }
+    fputs("]}", out);
+  } else {
+    fputs(",\n    {\"destination\": ", out);
+    jsonString(out, pwuid->pw_dir);
+    fputs(", \"type\": \"bind\", \"source\": ", out);
+    jsonString(out, fakeHome);
+    fputs(", \"options\": [\"rbind\"]}", out);
+  }
+  jsonBindMount(out, runtimeDir, "\"rbind\"");
+  for (int i = 0; i < flags.tmpfsCacheCount; ++i) {
+    char *size;
+    char *path = tmpfsCachePath(flags.tmpfsCaches[i], pwuid->pw_dir, &size);
+    fputs(",\n    {\"destination\": ", out);
+    jsonString(out, path);
+    fputs(", \"type\": \"tmpfs\", \"source\": \"tmpfs\", \"options\": [", out);
+    char *sizeOption = concat("size=", size, (char *)0);
+    jsonString(out, sizeOption);
+    fprintf(out, ", \"mode=0700\", \"uid=%lu\", \"gid=%lu\"]}",
+            (unsigned long)pwuid->pw_uid, (unsigned long)pwuid->pw_gid);
+    free(sizeOption);
+    free(path);
+  }
+  fputs("\n  ],\n", out);
+  free(fakeHome);
+
+  // There is no network namespace, as with --net=host
+  fputs("  \"linux\": {\n"
+        "    \"namespaces\": [{\"type\": \"pid\"}, {\"type\": \"ipc\"}, "
+        "{\"type\": \"mount\"}, {\"type\": \"user\"}],\n"
+        "    \"uidMappings\": ",
+        out);
+  jsonIdMappings(out, uidMaps, uidCount);
+  fputs(",\n    \"gidMappings\": ", out);
+  jsonIdMappings(out, gidMaps, gidCount);
+  fputs("\n  }\n}\n", out);
+  return ferror(out) ? EX_IOERR : 0;
+}
+
+// Adds the user to the container's passwd and group files if missing, like
+// podman does with --userns=keep-id. Must be called in the user namespace.
+void ociAddUser(char *rootfs, struct passwd *pwuid) {
+  char *files[] = {"/etc/passwd", "/etc/group"};
+  for (int i = 0; i < 2; ++i) {
+    char *path = concat(rootfs, files[i], (char *)0);
+    FILE *file = fopen(path, "a+");
+    free(path);
+    if (!file) {
+      continue;
+    }
+
+    char line[1024];
+    size_t nameLen = strlen(pwuid->pw_name);
+    bool found = false;
+    while (!found && fgets(line, sizeof(line), file)) {
+      found = !strncmp(line, pwuid->pw_name, nameLen) && line[nameLen] == ':';
+    }
+
+    if (!found) {
+      if (i) {
+        fprintf(file, "%s:x:%lu:\n", pwuid->pw_name,
+                (unsigned long)pwuid->pw_gid);
+      } else {
+        char *shell = concat(rootfs, pwuid->pw_shell, (char *)0);
+        fprintf(file, "%s:x:%lu:%lu::%s:%s\n", pwuid->pw_name,
+                (unsigned long)pwuid->pw_uid, (unsigned long)pwuid->pw_gid,
+                pwuid->pw_dir,
+                access(shell, X_OK) ? "/bin/sh" : pwuid->pw_shell);
+        free(shell);
+      }
+    }
+    fclose(file);
+  }
+}
+
+// Sets up /usr/bin/entrypoint and the user in an OCI container's rootfs.
+int ociInstallEntrypoint(struct Flags flags) {
+  struct passwd *pwuid = getpwuid(getuid());
+  if (!pwuid) {
+    fputs("Failed to get user information.\n", stderr);
     return EX_CONFIG;
   }
 
-  // Get the base name of the file
-  char *baseName = fileName;
-  for (int i = strlen(fileName); i-- > 0;) {
-    if (fileName[i] == '/') {
-      baseName = fileName + i + 1;
-      break;
-    }
+  char *self = selfPath();
+  if (!self) {
+    fputs("Error: Could not determine path to self.\n", stderr);
+    return EX_SOFTWARE;
+  }
+
+  char *bundle = ociBundlePath(flags.container);
+  char *rootfs = concat(bundle, "/rootfs", (char *)0);
+  char *binDir = concat(rootfs, "/usr/bin", (char *)0);
+  char *target = concat(rootfs, ENTRYPOINT, (char *)0);
+
+  int exitCode = 0;
+  if (flags.dryRun) {
+    char *argv[] = {"cp", self, target, 0};
+    printCommand(argv);
+  } else {
+    int childPid = forkUserNamespace();
+    if (!childPid) {
+      if (makeDirs(binDir) || copyFile(self, target, 0755)) {
+        exit(EX_CANTCREAT);
+      }
+      ociAddUser(rootfs, pwuid);
+      exit(0);
+    }
+    exitCode = childPid == -1 ? EX_OSERR : waitChild(childPid);
+  }
+
+  free(target);
+  free(binDir);
+  free(rootfs);
+  free(bundle);
+  free(self);
+
+  if (exitCode) {
+    fprintf(stderr,
+            "Failed to set up container entrypoint. Calling dizzybox upgrade "
+            "%s may be able to fix it.\n",
+            flags.container);
+    return EX_OSERR;
+  }
+  return 0;
+}
+
+// Unpacks the image's filesystem into rootfs through a temporary container.
+int ociUnpackImage(struct Flags flags, char *rootfs) {
+  char *exportName = concat("dizzybox-export-", flags.container, (char *)0);
+  char *createArgv[] = {flags.manager, "create", "--name", exportName,
+                        flags.image,   "/bin/true", 0};
+  char *exportArgv[] = {flags.manager, "export", exportName, 0};
+  char *tarArgv[] = {"tar", "-xpf", "-", "--numeric-owner", "-C", rootfs, 0};
+  char *rmArgv[] = {flags.manager, "rm", exportName, 0};
+
+  int exitCode = runCommand(flags, createArgv);
+  if (exitCode) {
+    free(exportName);
+    return exitCode;
+  }
+
+  if (flags.dryRun) {
+    printCommand(exportArgv);
+    printCommand(tarArgv);
+  } else {
+    int pipeline[2];
+    if (pipe(pipeline)) {
+      exitCode = EX_OSERR;
+    } else {
+      int exportPid = spawnCommand(exportArgv, -1, pipeline[1]);
+      close(pipeline[1]);
+
+      // Unpacking in the container's user namespace keeps file ownership.
+      int tarPid = forkUserNamespace();
+      if (!tarPid) {
+        dup2(pipeline[0], STDIN_FILENO);
+        close(pipeline[0]);
+        execvp(tarArgv[0], tarArgv);
+        fputs("Failed to run tar.\n", stderr);
+        exit(EX_OSERR);
+      }
+      close(pipeline[0]);
+
+      int exportStat = exportPid == -1 ? EX_OSERR : waitChild(exportPid);
+      int tarStat = tarPid == -1 ? EX_OSERR : waitChild(tarPid);
+      exitCode = exportStat ? exportStat : tarStat;
+    }
+  }
+
+  runCommand(flags, rmArgv);
+  free(exportName);
+  if (exitCode) {
+    fprintf(stderr, "Failed to unpack %s.\n", flags.image);
+  }
+  return exitCode;
+}
+
+// Deletes a bundle. A --rootfs is only a symlink, so it is left alone.
+int ociRemoveBundle(struct Flags flags, char *bundle) {
+  char *rmArgv[] = {"rm", "-rf", bundle, 0};
+  if (flags.dryRun) {
+    printCommand(rmArgv);
+    return 0;
+  }
+
+  // The rootfs has files owned by ids from the container's namespace
+  int childPid = forkUserNamespace();
+  if (!childPid) {
+    execvp(rmArgv[0], rmArgv);
+    exit(EX_OSERR);
+  }
+  return childPid == -1 ? EX_OSERR : waitChild(childPid);
+}
+
+// Creates a container as an OCI bundle, which is run by an OCI runtime
+// without going through the container manager.
+int ociCreate(struct Flags flags) {
+  char *bundle = ociBundlePath(flags.container);
+  char *rootfs = concat(bundle, "/rootfs", (char *)0);
+  char *configPath = concat(bundle, "/config.json", (char *)0);
+  char *runtimePath = concat(bundle, "/runtime", (char *)0);
+  char *sourceRootfs = 0;
+  bool madeBundle = false;
+  int exitCode = 0;
+
+  if (!access(bundle, F_OK)) {
+    fprintf(stderr, "The container %s already exists.\n", flags.container);
+    exitCode = EX_CANTCREAT;
+    goto cleanup;
+  }
+
+  if (flags.rootfs && !(sourceRootfs = realpath(flags.rootfs, 0))) {
+    fprintf(stderr, "The rootfs %s could not be found.\n", flags.rootfs);
+    exitCode = EX_NOINPUT;
+    goto cleanup;
+  }
+
+  if (!flags.dryRun && (exitCode = makeDirs(bundle))) {
+    goto cleanup;
+  }
+  madeBundle = !flags.dryRun;
+
+  if (sourceRootfs) {
+    // The rootfs is used in place rather than copied
+    fprintf(stderr,
+            "Note: The entrypoint and your user will be added to %s.\n",
+            sourceRootfs);
+    if (flags.dryRun) {
+      char *argv[] = {"ln", "-s", sourceRootfs, rootfs, 0};
+      printCommand(argv);
+    } else if (symlink(sourceRootfs, rootfs)) {
+      fprintf(stderr, "Failed to link %s.\n", rootfs);
+      exitCode = EX_CANTCREAT;
+      goto cleanup;
+    }
+  } else {
+    if (!flags.dryRun && mkdir(rootfs, 0755)) {
+      fprintf(stderr, "Failed to create directory %s.\n", rootfs);
+      exitCode = EX_CANTCREAT;
+      goto cleanup;
+    }
+    if ((exitCode = ociUnpackImage(flags, rootfs))) {
+      goto cleanup;
+    }
+  }
+
+  if (flags.dryRun) {
+    exitCode = writeOciConfig(stdout, flags, rootfs);
+  } else {
+    FILE *config = fopen(configPath, "w");
+    FILE *runtime = fopen(runtimePath, "w");
+    if (!config || !runtime) {
+      fprintf(stderr, "Failed to write the bundle in %s.\n", bundle);
+      exitCode = EX_CANTCREAT;
+    } else {
+      exitCode = writeOciConfig(config, flags, rootfs);
+      fprintf(runtime, "%s\n", flags.runtime);
+    }
+    if (config) {
+      fclose(config);
+    }
+    if (runtime) {
+      fclose(runtime);
+    }
+  }
+  if (exitCode) {
+    goto cleanup;
+  }
+
+  exitCode = ociInstallEntrypoint(flags);
+
+cleanup:
+  // A partial bundle would keep the name taken without being usable
+  if (exitCode && madeBundle) {
+    ociRemoveBundle(flags, bundle);
+  }
+  free(sourceRootfs);
+  free(runtimePath);
+  free(configPath);
+  free(rootfs);
+  free(bundle);
+  return exitCode;
+}
+
+// Starts an OCI container if it is not already running.
+int ociStart(struct Flags flags) {
+  char state[4096];
+  char *stateArgv[] = {flags.runtime, "state", flags.container, 0};
+  if (!captureCommand(stateArgv, state, sizeof(state))) {
+    if (strstr(state, "\"running\"")) {
+      return 0;
+    }
+    // Stopped containers must be deleted before running them again.
+    char *deleteArgv[] = {flags.runtime, "delete", "--force", flags.container,
+                          0};
+    runCommand(flags, deleteArgv);
+  }
+
+  char *bundle = ociBundlePath(flags.container);
+  char *argv[] = {flags.runtime, "run",           "--detach", "--bundle",
+                  bundle,        flags.container, 0};
+  if (flags.dryRun) {
+    printCommand(argv);
+    free(bundle);
+    return 0;
+  }
+
+  // Without conmon, the container's output goes to a file in the bundle.
+  char *logPath = concat(bundle, "/console.log", (char *)0);
+  int log = open(logPath, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  int devNull = open("/dev/null", O_RDONLY);
+  free(logPath);
+
+  int childPid = fork();
+  if (!childPid) {
+    dup2(devNull, STDIN_FILENO);
+    if (log != -1) {
+      dup2(log, STDOUT_FILENO);
+      dup2(log, STDERR_FILENO);
+    }
+    execvp(argv[0], argv);
+    exit(EX_OSERR);
+  }
+  close(log);
+  close(devNull);
+  free(bundle);
+
+  return childPid == -1 ? EX_OSERR : waitChild(childPid);
+}
+
+int ociRemove(struct Flags flags) {
+  char *deleteArgv[] = {flags.runtime, "delete", "--force", flags.container,
+                        0};
+  runCommand(flags, deleteArgv);
+
+  char *bundle = ociBundlePath(flags.container);
+  int exitCode = ociRemoveBundle(flags, bundle);
+  free(bundle);
+  return exitCode;
+}
+
+// Sets up /usr/bin/entrypoint in the container.
+int installEntrypoint(struct Flags flags) {
+  if (flags.runtime) {
+    return ociInstallEntrypoint(flags);
+  }
+
+  char *self = selfPath();
+  if (!self) {
+    fputs("Error: Could not determine path to self.\n", stderr);
+    return EX_SOFTWARE;
+  }
+
+  // Copy ourself as the entrypoint
+  int nameLen = strlen(flags.container);
+  char *cpTarget =
+      checkedMalloc(sizeof(char) * nameLen + sizeof(":" ENTRYPOINT));
+  strcpy(cpTarget, flags.container);
+  strcpy(cpTarget + nameLen, ":" ENTRYPOINT);
+
+  char *argv2[] = {flags.manager, "cp", self, cpTarget, 0};
+  int exitCode = runCommand(flags, argv2);
+
+  free(cpTarget);
+  free(self);
+
+  if (exitCode) {
+    fprintf(stderr,
+            "Failed to set up container entrypoint. Calling dizzybox upgrade "
+            "%s may be able to fix it.\n",
+            flags.container);
+    return EX_OSERR;
+  };
+
+  return 0;
+}
+
+// Reads until the buffer is full or the input ends, returning the length.
+size_t readFull(int fd, char *buffer, size_t len) {
+  size_t total = 0;
+  for (ssize_t n; total < len && (n = read(fd, buffer + total,
+                                           len - total)) > 0;) {
+    total += n;
+  }
+  return total;
+}
+
+// Writes the whole buffer. Returns -1 on failure
+int writeFull(int fd, char *buffer, size_t len) {
+  for (ssize_t n; len; buffer += n, len -= n) {
+    if ((n = write(fd, buffer, len)) <= 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+double monotonicSeconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Guesses from the first entry of a tar archive whether it is a saved image
+// (OCI or docker-archive) rather than a plain rootfs.
+bool isImageArchive(char header[512]) {
+  char name[101];
+  memcpy(name, header, 100);
+  name[100] = 0;
+
+  char *entry = name;
+  if (!strncmp(entry, "./", 2)) {
+    entry += 2;
+  }
+
+  static char *const imageEntries[] = {
+      "manifest.json", "index.json", "oci-layout", "repositories", "blobs/", 0,
+  };
+  for (char *const *p = imageEntries; *p; ++p) {
+    if (!strncmp(entry, *p, strlen(*p))) {
+      return true;
+    }
+  }
+
+  // docker-archive layers are stored under their hash
+  return strspn(entry, "0123456789abcdef") == 64;
+}
+
+// Imports a tarball, optionally compressed with xz, zstd or gzip, as an
+// image. The archive is decompressed as a stream and piped into podman, so
+// no uncompressed copy is written to disk. On success, *image is set to the
+// name of the image, which must be freed.
+int importArchive(struct Flags flags, char **image) {
+  int archive = open(flags.imageArchive, O_RDONLY);
+  if (archive == -1) {
+    fprintf(stderr, "Failed to open %s for reading.\n", flags.imageArchive);
+    return EX_NOINPUT;
+  }
+
+  unsigned char magic[6] = {0};
+  ssize_t magicLen = read(archive, magic, sizeof(magic));
+  lseek(archive, 0, SEEK_SET);
+
+  static struct {
+    unsigned char magic[6];
+    int magicLen;
+    char *argv[3];
+  } const decompressors[] = {
+      {{0xfd, '7', 'z', 'X', 'Z', 0}, 6, {"xz", "-dc", 0}},
+      {{0x28, 0xb5, 0x2f, 0xfd}, 4, {"zstd", "-dc", 0}},
+      {{0x1f, 0x8b}, 2, {"gzip", "-dc", 0}},
+  };
+  char *const *decompressArgv = 0;
+  for (size_t i = 0; i < sizeof(decompressors) / sizeof(*decompressors);
+       ++i) {
+    if (magicLen >= decompressors[i].magicLen &&
+        !memcmp(magic, decompressors[i].magic, decompressors[i].magicLen)) {
+      decompressArgv = decompressors[i].argv;
+    }
+  }
+
+  // Decompression happens in a separate process, reading the archive
+  // directly, while we relay its output.
+  int source = archive;
+  int decompressPid = 0;
+  if (decompressArgv) {
+    int decompressed[2];
+    if (pipe(decompressed)) {
+      close(archive);
+      return EX_OSERR;
+    }
+    decompressPid =
+        spawnCommand((char **)decompressArgv, archive, decompressed[1]);
+    close(decompressed[1]);
+    close(archive);
+    source = decompressed[0];
+    if (decompressPid == -1) {
+      close(source);
+      return EX_OSERR;
+    }
+  }
+
+  int exitCode = 0;
+  char header[512];
+  if (readFull(source, header, sizeof(header)) != sizeof(header) ||
+      memcmp(header + 257, "ustar", 5)) {
+    fprintf(stderr, "%s is not a tar archive.\n", flags.imageArchive);
+    exitCode = EX_DATAERR;
+    goto cleanup;
+  }
+
+  char *importName = concat("localhost/dizzybox-", flags.container, (char *)0);
+  char *loadArgv[] = {flags.manager, "load", 0};
+  char *importArgv[] = {flags.manager, "import",
+                        "--change=LABEL=" MANAGED_LABEL, "-", importName, 0};
+  char **argv = isImageArchive(header) ? loadArgv : importArgv;
+  if (flags.dryRun) {
+    if (decompressArgv) {
+      printf("%s %s %s | ", decompressArgv[0], decompressArgv[1],
+             flags.imageArchive);
+    }
+    printCommand(argv);
+    if (argv == loadArgv) {
+      char *tagArgv[] = {flags.manager, "tag", "LOADED-IMAGE", importName, 0};
+      printCommand(tagArgv);
+    }
+    *image = importName;
+    goto cleanup;
+  }
+
+  int input[2], output[2];
+  if (pipe(input)) {
+    free(importName);
+    exitCode = EX_OSERR;
+    goto cleanup;
+  }
+  if (pipe(output)) {
+    close(input[0]);
+    close(input[1]);
+    free(importName);
+    exitCode = EX_OSERR;
+    goto cleanup;
+  }
+  fcntl(input[1], F_SETFD, FD_CLOEXEC);
+  fcntl(output[0], F_SETFD, FD_CLOEXEC);
+  int managerPid = spawnCommand(argv, input[0], output[1]);
+  close(input[0]);
+  close(output[1]);
+
+  // A failing manager should be reported, not kill us.
+  struct sigaction ignore = {.sa_handler = SIG_IGN}, oldPipeHandler;
+  sigaction(SIGPIPE, &ignore, &oldPipeHandler);
+
+  char buffer[1 << 16];
+  memcpy(buffer, header, sizeof(header));
+  ssize_t len = sizeof(header);
+  size_t total = 0;
+  bool progress = isatty(STDERR_FILENO);
+  double start = monotonicSeconds(), lastReport = start;
+  for (;;) {
+    if (writeFull(input[1], buffer, len)) {
+      exitCode = EX_IOERR;
+      break;
+    }
+    total += len;
+
+    double now = monotonicSeconds();
+    if (progress && now - lastReport >= 0.5) {
+      lastReport = now;
+      fprintf(stderr, "\rImported %.1f MiB at %.1f MiB/s ",
+              total / 1048576.0, total / 1048576.0 / (now - start));
+    }
+
+    while ((len = read(source, buffer, sizeof(buffer))) == -1 &&
+           errno == EINTR)
+      ;
+    if (len == -1) {
+      fprintf(stderr, "\nFailed to read %s.\n", flags.imageArchive);
+      exitCode = EX_IOERR;
+    }
+    if (len <= 0) {
+      break;
+    }
+  }
+
+  // A truncated archive also ends in EOF, so the manager must not see the end
+  // of its input before the decompressor is known to have succeeded.
+  if (!exitCode && decompressPid > 0) {
+    int decompressStat = waitChild(decompressPid);
+    decompressPid = 0;
+    if (decompressStat) {
+      fprintf(stderr, "\nFailed to decompress %s.\n", flags.imageArchive);
+      exitCode = EX_DATAERR;
+      if (managerPid > 0) {
+        kill(managerPid, SIGTERM);
+      }
+    }
+  }
+  close(input[1]);
+
+  double elapsed = monotonicSeconds() - start;
+  fprintf(stderr, "%sImported %.1f MiB in %.1fs (%.1f MiB/s)\n",
+          progress ? "\r" : "", total / 1048576.0, elapsed,
+          elapsed > 0 ? total / 1048576.0 / elapsed : 0);
+
+  char result[4096];
+  result[readFull(output[0], result, sizeof(result) - 1)] = 0;
+  close(output[0]);
+  sigaction(SIGPIPE, &oldPipeHandler, 0);
+
+  int managerStat = managerPid == -1 ? EX_OSERR : waitChild(managerPid);
+  if (managerStat && !exitCode) {
+    exitCode = managerStat;
+  }
+
+  if (argv == importArgv) {
+    if (!exitCode) {
+      *image = importName;
+    } else {
+      // The import may have finished before it was stopped
+      if (!managerStat) {
+        char *rmiArgv[] = {flags.manager, "rmi", importName, 0};
+        runCommand(flags, rmiArgv);
+      }
+      free(importName);
+    }
+  } else {
+    // "Loaded image: NAME" or "Loaded image(s): NAME,..."
+    char *name = strstr(result, "Loaded image");
+    if (name && (name = strchr(name, ':'))) {
+      name += 1 + strspn(name + 1, " ");
+      name[strcspn(name, ",\n")] = 0;
+      // Loaded images can't be labelled, so they are tagged like imported
+      // ones for gc to find.
+      char *tagArgv[] = {flags.manager, "tag", name, importName, 0};
+      if (!exitCode && runCommand(flags, tagArgv)) {
+        fprintf(stderr, "Failed to tag %s as %s.\n", name, importName);
+        exitCode = EX_SOFTWARE;
+      }
+    } else if (!exitCode) {
+      fputs("Could not find the name of the loaded image.\n", stderr);
+      exitCode = EX_DATAERR;
+    }
+    if (exitCode) {
+      free(importName);
+    } else {
+      *image = importName;
+    }
+  }
+  if (exitCode) {
+    fprintf(stderr, "Failed to import %s.\n", flags.imageArchive);
+  }
+
+cleanup:
+  close(source);
+  if (decompressPid > 0) {
+    // The decompressor may still be writing if we stopped early
+    kill(decompressPid, SIGTERM);
+    waitChild(decompressPid);
+  }
+  return exitCode;
+}
+
+// A package cache that can be shared by all containers of a distro family.
+// The package managers either lock with fcntl on files inside the cache,
+// which works across containers, or only ever add complete files by renaming
+// them into place, so concurrent use from several containers is safe.
+struct PackageCache {
+  // Matched against ID and ID_LIKE from os-release, or the dnf version
+  char *family;
+  char *volume;
+  char *path;
+  // A config file that makes the package manager keep downloaded packages
+  char *configPath, *config;
+};
+
+static const struct PackageCache packageCaches[] = {
+    {"arch", "dizzybox-cache-pacman", "/var/cache/pacman/pkg", 0, 0},
+    {"alpine", "dizzybox-cache-apk", "/etc/apk/cache", 0, 0},
+    // Docker images delete packages after installation in docker-clean
+    {"debian", "dizzybox-cache-apt", "/var/cache/apt/archives",
+     "/etc/apt/apt.conf.d/docker-clean",
+     "Binary::apt::APT::Keep-Downloaded-Packages \"true\";\n"},
+    {"dnf5", "dizzybox-cache-dnf5", "/var/cache/libdnf5",
+     "/etc/dnf/libdnf5.conf.d/20-dizzybox-cache.conf",
+     "[main]\nkeepcache=True\n"},
+    // dnf4 has no drop-in configs; keepcache must be set by hand
+    {"dnf", "dizzybox-cache-dnf", "/var/cache/dnf", 0, 0},
+};
+
+// Finds the package cache for an image by reading its os-release. Which dnf
+// an image has depends on the release rather than the distro, so dnf based
+// images are told apart by what /usr/bin/dnf is.
+// Returns null if the distro is not known.
+const struct PackageCache *detectPackageCache(struct Flags flags) {
+  char *argv[] = {flags.manager,
+                  "run",
+                  "--rm",
+                  "--entrypoint=/bin/sh",
+                  flags.image,
+                  "-c",
+                  "cat /etc/os-release /usr/lib/os-release;"
+                  "[ -e /usr/bin/dnf ] && case $(readlink -f /usr/bin/dnf) in"
+                  " */dnf5) echo ID=dnf5;; *) echo ID=dnf;; esac",
+                  0};
+  char osRelease[8192];
+  captureCommand(argv, osRelease, sizeof(osRelease));
+
+  // Later lines take priority, so the dnf check overrides the distro.
+  char *id = 0, *idLike = 0;
+  for (char *line = strtok(osRelease, "\n"); line; line = strtok(0, "\n")) {
+    if (!strncmp(line, "ID=", 3)) {
+      id = line + 3;
+    } else if (!strncmp(line, "ID_LIKE=", 8)) {
+      idLike = line + 8;
+    }
+  }
+
+  char *families[] = {id, idLike};
+  for (int i = 0; i < 2; ++i) {
+    if (!families[i]) {
+      continue;
+    }
+    for (char *family = strtok(families[i], "\" "); family;
+         family = strtok(0, "\" ")) {
+      for (size_t c = 0; c < sizeof(packageCaches) / sizeof(*packageCaches);
+           ++c) {
+        if (!strcmp(family, packageCaches[c].family)) {
+          return packageCaches + c;
+        }
+      }
+    }
+  }
+  return 0;
+}
+
+// Makes the container keep the packages it downloads in the shared cache.
+void configurePackageCache(struct Flags flags,
+                           const struct PackageCache *cache) {
+  if (!cache->configPath) {
+    return;
+  }
+
+  char *cpTarget = concat(flags.container, ":", cache->configPath, (char *)0);
+  char configFile[] = "/tmp/dizzybox-cache-XXXXXX";
+  int fd = flags.dryRun ? -1 : mkstemp(configFile);
+  if (!flags.dryRun &&
+      (fd == -1 ||
+       writeFull(fd, cache->config, strlen(cache->config)) || close(fd))) {
+    fputs("Warning: Failed to write the package cache config.\n", stderr);
+    free(cpTarget);
+    return;
+  }
+
+  char *argv[] = {flags.manager, "cp", configFile, cpTarget, 0};
+  if (runCommand(flags, argv)) {
+    fprintf(stderr,
+            "Warning: Failed to configure the package manager to keep "
+            "packages in %s.\n",
+            cache->path);
+  }
+  if (!flags.dryRun) {
+    unlink(configFile);
+  }
+  free(cpTarget);
+}
+
+// Totals for one package cache, filled in by cacheVisit through nftw.
+static struct {
+  time_t pruneBefore; // Files last used before this are removed, if set
+  bool dryRun;
+  unsigned long long size, freed;
+  unsigned long files, pruned;
+} cacheStats;
+
+int cacheVisit(const char *path, const struct stat *info, int type,
+               struct FTW *ftw) {
+  (void)ftw;
+  if (type != FTW_F) {
+    return 0;
+  }
+
+  unsigned long long size = (unsigned long long)info->st_blocks * 512;
+  time_t used = info->st_atime > info->st_mtime ? info->st_atime
+                                                : info->st_mtime;
+  const char *name = strrchr(path, '/');
+  name = name ? name + 1 : path;
+  if (cacheStats.pruneBefore && used < cacheStats.pruneBefore &&
+      strcmp(name, "lock")) {
+    if (cacheStats.dryRun) {
+      printf("rm %s\n", path);
+    }
+    if (cacheStats.dryRun || !unlink(path)) {
+      cacheStats.freed += size;
+      ++cacheStats.pruned;
+      return 0;
+    }
+  }
+
+  cacheStats.size += size;
+  ++cacheStats.files;
+  return 0;
+}
+
+// Whether files owned by users in the containers can't be accessed yet.
+bool needsUnshare(void) {
+  return getuid() && !getenv("_CONTAINERS_USERNS_CONFIGURED");
+}
+
+// Runs a subcommand again in the manager's user namespace, with the same
+// flags. Only returns on failure.
+int unshareSelf(struct Flags flags, char *subcommand) {
+  char *self = selfPath();
+  if (!self) {
+    fputs("Error: Could not determine path to self.\n", stderr);
+    return EX_SOFTWARE;
+  }
+
+  char prune[32], maxAge[32], idle[32], maxSize[32];
+  char *argv[16] = {flags.manager, "unshare", self, subcommand};
+  int argc = 4;
+  if (flags.dryRun) {
+    argv[argc++] = "--dry-run";
+  }
+  if (flags.pruneDays >= 0) {
+    snprintf(prune, sizeof(prune), "%d", flags.pruneDays);
+    argv[argc++] = "--prune";
+    argv[argc++] = prune;
+  }
+  if (flags.maxAgeDays >= 0) {
+    snprintf(maxAge, sizeof(maxAge), "%d", flags.maxAgeDays);
+    argv[argc++] = "--max-age";
+    argv[argc++] = maxAge;
+  }
+  if (flags.idleDays >= 0) {
+    snprintf(idle, sizeof(idle), "%d", flags.idleDays);
+    argv[argc++] = "--idle";
+    argv[argc++] = idle;
+  }
+  if (flags.maxSize) {
+    snprintf(maxSize, sizeof(maxSize), "%llu", flags.maxSize);
+    argv[argc++] = "--max-size";
+    argv[argc++] = maxSize;
+  }
+  argv[argc] = 0;
+
+  // getpwuid would find root's home in the namespace
+  setenv("_DIZZYBOX_HOME", userHome(), 1);
+  execvp(argv[0], argv);
+  fprintf(stderr, "Failed to run %s.\n", argv[0]);
+  return EX_OSERR;
+}
+
+// Reports the size of the shared package caches and prunes old packages.
+int cacheCommand(struct Flags flags) {
+  // Files in the caches belong to users in the containers, so this is done
+  // in the manager's user namespace.
+  if (needsUnshare()) {
+    return unshareSelf(flags, "cache");
+  }
+
+  printf("%-24s %12s %8s %12s\n", "VOLUME", "SIZE", "FILES", "PRUNED");
+  for (size_t c = 0; c < sizeof(packageCaches) / sizeof(*packageCaches);
+       ++c) {
+    char mountpoint[4096];
+    char *argv[] = {flags.manager,
+                    "volume",
+                    "inspect",
+                    "--format",
+                    "{{.Mountpoint}}",
+                    packageCaches[c].volume,
+                    0};
+    if (captureCommand(argv, mountpoint, sizeof(mountpoint))) {
+      continue; // Not created yet
+    }
+    mountpoint[strcspn(mountpoint, "\n")] = 0;
+
+    memset(&cacheStats, 0, sizeof(cacheStats));
+    cacheStats.dryRun = flags.dryRun;
+    if (flags.pruneDays >= 0) {
+      cacheStats.pruneBefore = time(0) - (time_t)flags.pruneDays * 86400;
+    }
+    if (nftw(mountpoint, cacheVisit, 16, FTW_PHYS)) {
+      fprintf(stderr, "Warning: Failed to read all of %s.\n", mountpoint);
+    }
+    printf("%-24s %8.1f MiB %8lu %8.1f MiB\n", packageCaches[c].volume,
+           cacheStats.size / 1048576.0, cacheStats.files,
+           cacheStats.freed / 1048576.0);
+  }
+  return 0;
+}
+
+int containerCreate(struct Flags flags) {
+  if (flags.rootfs && !flags.runtime) {
+    fputs("--rootfs needs --runtime, podman always uses an image.\n", stderr);
+    return EX_USAGE;
+  }
+
+  if (flags.imageArchive) {
+    char *image;
+    int exitCode = importArchive(flags, &image);
+    if (exitCode) {
+      return exitCode;
+    }
+
+    flags.image = image;
+    flags.imageArchive = 0;
+    exitCode = containerCreate(flags);
+    free(image);
+    return exitCode;
+  }
+
+  if (flags.homeOverlay && !flags.fakeHome) {
+    fputs("--home-overlay needs --fake-home to keep the changes in.\n", stderr);
+    return EX_USAGE;
+  }
+
+  if (flags.runtime) {
+    if (flags.sharedCache) {
+      fputs("Warning: --shared-cache is only supported with podman.\n",
+            stderr);
+    }
+    return ociCreate(flags);
+  }
+
+  struct passwd *pwuid = getpwuid(getuid());
+  if (!pwuid) {
+    fputs("Failed to get user home information.\n", stderr);
+    return EX_CONFIG;
+  }
+
+  char *runtimeDir = getenv("XDG_RUNTIME_DIR");
+  if (!runtimeDir) {
+    fputs("The XDG_RUNTIME_DIR environment variable must be set!\n", stderr);
+    return EX_CONFIG;
+  }
+
+  char *homeVolume;
+  if (flags.fakeHome) {
+    char *fakeHome = prepareFakeHome(flags, pwuid->pw_dir);
+    if (!fakeHome) {
+      return EX_CANTCREAT;
+    }
+    if (flags.homeOverlay) {
+      // Reads fall through to the real home, and writes go to the fake one.
+      homeVolume = concat(pwuid->pw_dir, ":", pwuid->pw_dir, ":O,upperdir=",
+                          fakeHome, "/upper,workdir=", fakeHome, "/work",
+                          (char *)0);
+    } else {
+      homeVolume = concat(fakeHome, ":", pwuid->pw_dir, (char *)0);
+    }
+    free(fakeHome);
+  } else {
+    homeVolume = mountString(pwuid->pw_dir);
+  }
+  char *runtimeVolume = mountString(runtimeDir);
+
+  const struct PackageCache *cache = 0;
+  char *cacheVolume = 0;
+  if (flags.sharedCache) {
+    cache = detectPackageCache(flags);
+    if (cache) {
+      cacheVolume = concat(cache->volume, ":", cache->path, (char *)0);
+    } else {
+      fprintf(stderr, "Warning: No shared package cache is known for %s.\n",
+              flags.image);
+    }
+  }
+
+  char *baseArgs[] = {
+      flags.manager,
+      "create",
+      "--privileged",
+      "--net=host",
+      "--user=0:0",
+      "--volume=/run/host:/run/host",
+      "--volume=/tmp:/tmp",
+      "--volume=/dev:/dev",
+      "--mount=type=devpts,destination=/dev/pts",
+      ("--entrypoint=" ENTRYPOINT),
+      "--userns=keep-id",
+      ("--label=" MANAGED_LABEL),
+      "--volume",
+      homeVolume,
+      "--volume",
+      runtimeVolume,
+  };
+  // Room for the base arguments and the optional ones below
+  char *argv[sizeof(baseArgs) / sizeof(*baseArgs) + 8 + 2 * TMPFS_CACHES_MAX];
+  int argc = sizeof(baseArgs) / sizeof(*baseArgs);
+  memcpy(argv, baseArgs, sizeof(baseArgs));
+
+  if (cacheVolume) {
+    argv[argc++] = "--volume";
+    argv[argc++] = cacheVolume;
+  }
+
+  char *tmpfsArgs[TMPFS_CACHES_MAX];
+  for (int i = 0; i < flags.tmpfsCacheCount; ++i) {
+    char *size, uidOptions[64];
+    char *path = tmpfsCachePath(flags.tmpfsCaches[i], pwuid->pw_dir, &size);
+    snprintf(uidOptions, sizeof(uidOptions), ",mode=0700,uid=%lu,gid=%lu",
+             (unsigned long)pwuid->pw_uid, (unsigned long)pwuid->pw_gid);
+    tmpfsArgs[i] = concat(path, ":rw,size=", size, uidOptions, (char *)0);
+    free(path);
+
+    argv[argc++] = "--tmpfs";
+    argv[argc++] = tmpfsArgs[i];
+  }
+
+  // The entrypoint logs the output of hooks where dizzybox logs can find it
+  char *log = logPath(flags.container);
+  char *logEnv = concat("--env=DIZZYBOX_LOG=", log, (char *)0);
+  free(log);
+  argv[argc++] = logEnv;
+
+  argv[argc++] = "--name";
+  argv[argc++] = flags.container;
+  argv[argc++] = flags.image;
+  argv[argc] = 0;
+
+  int exitCode = runCommand(flags, argv);
+  for (int i = 0; i < flags.tmpfsCacheCount; ++i) {
+    free(tmpfsArgs[i]);
+  }
+  free(logEnv);
+  free(cacheVolume);
+  free(runtimeVolume);
+  free(homeVolume);
+  if (exitCode) {
+    return exitCode;
+  }
+
+  if (cache) {
+    configurePackageCache(flags, cache);
+  }
+
+  exitCode = installEntrypoint(flags);
+  if (exitCode) {
+    return exitCode;
+  }
+
+  return 0;
+}
+
+// Header of a log file. The rest of the file is a ring buffer of lines,
+// written by the entrypoint and read concurrently without locks: the writer
+// advances reserved before overwriting old data and end after writing new
+// data, so readers can tell which of the bytes they copied were intact.
+struct LogHeader {
+  char magic[8];
+  uint64_t size;     // Size of the ring buffer
+  uint64_t reserved; // Total bytes written, including ones being written
+  uint64_t end;      // Total bytes written
+};
+
+#define LOG_MAGIC "dzlog1"
+
+// Output of a hook being captured into the log, line by line.
+struct LogSource {
+  int fd;
+  char tag[32];
+  size_t len;
+  char line[LOG_LINE_MAX];
+};
+
+static struct LogHeader *entrypointLog;
+static struct LogSource logSources[LOG_SOURCES_MAX];
+static int logSourceCount;
+
+// Maps a log file, creating it if writable. Returns null on failure
+struct LogHeader *logOpen(char *path, bool writable) {
+  int fd = open(path, writable ? O_RDWR | O_CREAT | O_CLOEXEC : O_RDONLY,
+                0644);
+  if (fd == -1) {
+    return 0;
+  }
+
+  off_t fileSize = sizeof(struct LogHeader) + LOG_SIZE;
+  struct stat info;
+  if (fstat(fd, &info) || (info.st_size != fileSize &&
+                           (!writable || ftruncate(fd, fileSize)))) {
+    close(fd);
+    return 0;
+  }
+
+  struct LogHeader *log =
+      mmap(0, fileSize, writable ? PROT_READ | PROT_WRITE : PROT_READ,
+           MAP_SHARED, fd, 0);
+  close(fd);
+  if (log == MAP_FAILED) {
+    return 0;
+  }
+
+  if (memcmp(log->magic, LOG_MAGIC, sizeof(LOG_MAGIC)) ||
+      log->size != LOG_SIZE) {
+    if (!writable) {
+      munmap(log, fileSize);
+      return 0;
+    }
+    // Start over with an empty log
+    memset(log, 0, sizeof(*log));
+    log->size = LOG_SIZE;
+    memcpy(log->magic, LOG_MAGIC, sizeof(LOG_MAGIC));
+  }
+  return log;
+}
+
+// Appends a timestamped, tagged line to the entrypoint's log.
+void logWrite(char *tag, char *line, size_t len) {
+  if (!entrypointLog) {
+    return;
+  }
+
+  char buffer[LOG_LINE_MAX + 128];
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  struct tm time;
+  gmtime_r(&now.tv_sec, &time);
+  size_t prefixLen = strftime(buffer, 32, "%Y-%m-%dT%H:%M:%S", &time);
+  prefixLen += snprintf(buffer + prefixLen, sizeof(buffer) - prefixLen,
+                        ".%03ldZ %s: ", now.tv_nsec / 1000000, tag);
+  if (len > sizeof(buffer) - prefixLen - 1) {
+    len = sizeof(buffer) - prefixLen - 1;
+  }
+  memcpy(buffer + prefixLen, line, len);
+  len += prefixLen;
+  buffer[len++] = '\n';
+
+  char *data = (char *)(entrypointLog + 1);
+  uint64_t end = entrypointLog->end;
+  __atomic_store_n(&entrypointLog->reserved, end + len, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  for (size_t written = 0; written < len;) {
+    size_t at = (end + written) % LOG_SIZE;
+    size_t chunk = len - written;
+    if (chunk > LOG_SIZE - at) {
+      chunk = LOG_SIZE - at;
+    }
+    memcpy(data + at, buffer + written, chunk);
+    written += chunk;
+  }
+  __atomic_store_n(&entrypointLog->end, end + len, __ATOMIC_RELEASE);
+}
+
+// Captures the output of a hook into the log, returning the pipe's write
+// end, or -1 if it is not being logged.
+int logCapture(char *tag) {
+  int fds[2];
+  if (!entrypointLog || logSourceCount == LOG_SOURCES_MAX ||
+      pipe2(fds, O_CLOEXEC)) {
+    return -1;
+  }
+
+  struct LogSource *source = logSources + logSourceCount++;
+  source->fd = fds[0];
+  source->len = 0;
+  snprintf(source->tag, sizeof(source->tag), "%s", tag);
+  return fds[1];
+}
+
+// Reads output from a log source. Returns -1 once it has closed.
+int logRead(int index) {
+  struct LogSource *source = logSources + index;
+  ssize_t n = read(source->fd, source->line + source->len,
+                   sizeof(source->line) - source->len);
+  if (n > 0) {
+    source->len += n;
+  }
+
+  // Log each complete line, or the buffer if it has filled up
+  char *start = source->line, *end = source->line + source->len;
+  for (char *newline; (newline = memchr(start, '\n', end - start));
+       start = newline + 1) {
+    logWrite(source->tag, start, newline - start);
+  }
+  if (start == source->line && source->len == sizeof(source->line)) {
+    logWrite(source->tag, start, source->len);
+    start = end;
+  }
+  if (n <= 0 && start < end) {
+    logWrite(source->tag, start, end - start);
+    start = end;
+  }
+  source->len = end - start;
+  memmove(source->line, start, source->len);
+
+  if (n > 0 || (n == -1 && errno == EINTR)) {
+    return 0;
+  }
+
+  close(source->fd);
+  *source = logSources[--logSourceCount];
+  return -1;
+}
+
+// Prints a container's log, and keeps printing new lines with --follow.
+int logsCommand(struct Flags flags) {
+  char *path = logPath(flags.container);
+  if (!path) {
+    return EX_CONFIG;
+  }
+  struct LogHeader *log = logOpen(path, false);
+  if (!log) {
+    fprintf(stderr,
+            "No log was found at %s. Logs are written while the container "
+            "runs, and containers created by older versions of dizzybox need "
+            "to be recreated to have one.\n",
+            path);
+    free(path);
+    return EX_NOINPUT;
+  }
+  free(path);
+
+  char *data = (char *)(log + 1);
+  char *buffer = checkedMalloc(LOG_SIZE);
+  uint64_t position = 0;
+  for (;;) {
+    uint64_t end = __atomic_load_n(&log->end, __ATOMIC_ACQUIRE);
+    if (end < position) {
+      position = 0; // The log was reset
+    }
+    uint64_t start = end > LOG_SIZE && end - LOG_SIZE > position
+                         ? end - LOG_SIZE
+                         : position;
+    for (uint64_t p = start; p < end;) {
+      size_t at = p % LOG_SIZE;
+      size_t chunk = end - p;
+      if (chunk > LOG_SIZE - at) {
+        chunk = LOG_SIZE - at;
+      }
+      memcpy(buffer + (p - start), data + at, chunk);
+      p += chunk;
+    }
+
+    // Drop anything that was overwritten while copying, up to a full line
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    uint64_t reserved = __atomic_load_n(&log->reserved, __ATOMIC_RELAXED);
+    char *out = buffer, *outEnd = buffer + (end - start);
+    if (reserved > LOG_SIZE && reserved - LOG_SIZE > start) {
+      out += reserved - LOG_SIZE - start;
+      if (out > outEnd) {
+        out = outEnd;
+      }
+      char *newline = memchr(out, '\n', outEnd - out);
+      out = newline ? newline + 1 : outEnd;
+    } else if (start > position) {
+      // Older lines have been overwritten, so skip the partial first one
+      char *newline = memchr(out, '\n', outEnd - out);
+      out = newline ? newline + 1 : outEnd;
+    }
+    if (writeFull(STDOUT_FILENO, out, outEnd - out)) {
+      break;
+    }
+    position = end;
+
+    if (!flags.follow) {
+      break;
+    }
+    struct timespec interval = {.tv_nsec = 200 * 1000 * 1000};
+    nanosleep(&interval, 0);
+  }
+
+  free(buffer);
+  munmap(log, sizeof(struct LogHeader) + LOG_SIZE);
+  return 0;
+}
+
+// Returns the socket path of a session, which is the same on the host and in
+// the container since XDG_RUNTIME_DIR is shared.
+// Returned pointer must be freed
+char *sessionPath(char *container, char *session) {
+  char *runtimeDir = getenv("XDG_RUNTIME_DIR");
+  if (!runtimeDir) {
+    fputs("The XDG_RUNTIME_DIR environment variable must be set!\n", stderr);
+    return 0;
+  }
+  return concat(runtimeDir, "/dizzybox/sessions/", container, "/", session,
+                ".sock", (char *)0);
+}
+
+// Connects to a session or the entrypoint's session control socket.
+// Returns -1 on failure
+int sessionConnect(char *path) {
+  struct sockaddr_un address = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    return -1;
+  }
+  strcpy(address.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    return -1;
+  }
+  if (connect(fd, (struct sockaddr *)&address, sizeof(address))) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Creates a listening socket, replacing any stale one.
+// Returns -1 on failure
+int sessionListen(char *path, mode_t mode) {
+  struct sockaddr_un address = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    return -1;
+  }
+  strcpy(address.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    return -1;
+  }
+  unlink(path);
+  if (bind(fd, (struct sockaddr *)&address, sizeof(address)) ||
+      chmod(path, mode) || listen(fd, SESSION_CLIENTS_MAX)) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static volatile sig_atomic_t sessionResized = 0;
+
+void sessionResizeHandler(int signal) {
+  (void)signal; // mark as unused
+  sessionResized = 1;
+}
+
+// Relays the terminal to a connected session until it ends or the user
+// detaches by pressing the detach key.
+// Messages to the session start with a byte saying what they contain:
+// 'i' for input, or 'w' for a struct winsize.
+int sessionAttach(int session) {
+  bool isTerminal = isatty(STDIN_FILENO);
+  struct termios savedTerminal;
+  if (isTerminal) {
+    tcgetattr(STDIN_FILENO, &savedTerminal);
+    struct termios raw = savedTerminal;
+    cfmakeraw(&raw);
+    tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+
+    struct sigaction resizeHandler = {.sa_handler = sessionResizeHandler};
+    sigaction(SIGWINCH, &resizeHandler, 0);
+    sessionResized = 1;
+  }
+
+  char buffer[SESSION_MESSAGE_MAX];
+  bool detached = false;
+  struct pollfd fds[] = {{.fd = STDIN_FILENO, .events = POLLIN},
+                         {.fd = session, .events = POLLIN}};
+  for (;;) {
+    if (sessionResized) {
+      sessionResized = 0;
+      struct winsize size;
+      if (!ioctl(STDIN_FILENO, TIOCGWINSZ, &size)) {
+        buffer[0] = 'w';
+        memcpy(buffer + 1, &size, sizeof(size));
+        send(session, buffer, sizeof(size) + 1, MSG_NOSIGNAL);
+      }
+    }
+
+    if (poll(fds, 2, -1) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+
+    if (fds[1].revents) {
+      ssize_t n = recv(session, buffer, sizeof(buffer), 0);
+      if (n <= 0 || writeFull(STDOUT_FILENO, buffer, n)) {
+        break; // The session ended
+      }
+    }
+
+    if (fds[0].revents) {
+      ssize_t n = read(STDIN_FILENO, buffer + 1, sizeof(buffer) - 1);
+      char *key = n > 0 && isTerminal ? memchr(buffer + 1, DETACH_KEY, n) : 0;
+      if (n <= 0 || key) {
+        detached = true;
+        n = key ? key - (buffer + 1) : 0;
+      }
+      buffer[0] = 'i';
+      if (n > 0 && send(session, buffer, n + 1, MSG_NOSIGNAL) == -1) {
+        break;
+      }
+      if (detached) {
+        break;
+      }
+    }
+  }
+
+  if (isTerminal) {
+    tcsetattr(STDIN_FILENO, TCSANOW, &savedTerminal);
+    struct sigaction defaultHandler = {.sa_handler = SIG_DFL};
+    sigaction(SIGWINCH, &defaultHandler, 0);
+  }
+  close(session);
+  if (detached) {
+    fputs("\n[detached]\n", stderr);
+  }
+  return 0;
+}
+
+// Starts a session in the container for the command in argv, running on a
+// pty that is handed to the entrypoint so it outlives us. The session is
+// named by DIZZYBOX_SESSION, and left running if DIZZYBOX_DETACH is set.
+int sessionCreate(char *argv[]) {
+  char *path = concat(getenv("DIZZYBOX_SESSION"), (char *)0);
+  bool detach = getenv("DIZZYBOX_DETACH");
+  unsetenv("DIZZYBOX_SESSION");
+  unsetenv("DIZZYBOX_DETACH");
+
+  // It may have been started since the host checked
+  int session = sessionConnect(path);
+  if (session != -1) {
+    free(path);
+    if (detach) {
+      close(session);
+      return 0;
+    }
+    return sessionAttach(session);
+  }
+
+  char *dir = concat(path, (char *)0);
+  *strrchr(dir, '/') = 0;
+  int listener = makeDirs(dir) ? -1 : sessionListen(path, 0600);
+  free(dir);
+  if (listener == -1) {
+    fprintf(stderr, "Failed to create the session socket %s.\n", path);
+    free(path);
+    return EX_CANTCREAT;
+  }
+
+  int master = posix_openpt(O_RDWR | O_NOCTTY);
+  char *slaveName;
+  if (master == -1 || grantpt(master) || unlockpt(master) ||
+      !(slaveName = ptsname(master))) {
+    fputs("Failed to create a pty.\n", stderr);
+    free(path);
+    return EX_OSERR;
+  }
+  fcntl(master, F_SETFD, FD_CLOEXEC);
+
+  struct winsize size;
+  if (!ioctl(STDIN_FILENO, TIOCGWINSZ, &size)) {
+    ioctl(master, TIOCSWINSZ, &size);
+  }
+
+  int childPid = fork();
+  if (childPid == -1) {
+    fputs("Failed to fork.\n", stderr);
+    free(path);
+    return EX_OSERR;
+  }
+
+  if (!childPid) {
+    setsid();
+    int slave = open(slaveName, O_RDWR);
+    if (slave == -1 || ioctl(slave, TIOCSCTTY, 0)) {
+      exit(EX_OSERR);
+    }
+    for (int fd = 0; fd < 3; ++fd) {
+      dup2(slave, fd);
+    }
+    close(slave);
+    execvp(argv[0], argv);
+    fprintf(stderr, "Failed to run %s.\n", argv[0]);
+    exit(EX_OSERR);
+  }
+
+  // Hand the pty and socket over to the entrypoint
+  int control = sessionConnect(SESSION_CONTROL);
+  char ack = 0;
+  if (control != -1) {
+    int fds[] = {master, listener};
+    char controlBuffer[CMSG_SPACE(sizeof(fds))];
+    char data = 's';
+    struct iovec iov = {.iov_base = &data, .iov_len = 1};
+    struct msghdr message = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = controlBuffer,
+        .msg_controllen = sizeof(controlBuffer),
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    if (sendmsg(control, &message, MSG_NOSIGNAL) != 1 ||
+        recv(control, &ack, 1, 0) != 1) {
+      ack = 0;
+    }
+    close(control);
+  }
+  close(master);
+  close(listener);
+
+  if (!ack) {
+    kill(childPid, SIGHUP);
+    unlink(path);
+    free(path);
+    fputs("The entrypoint does not support sessions. Run dizzybox upgrade and "
+          "restart the container.\n",
+          stderr);
+    return EX_UNAVAILABLE;
+  }
+
+  if (detach) {
+    free(path);
+    return 0;
+  }
+
+  session = sessionConnect(path);
+  free(path);
+  if (session == -1) {
+    fputs("Failed to attach to the session.\n", stderr);
+    return EX_UNAVAILABLE;
+  }
+  return sessionAttach(session);
+}
+
+// A session held by the entrypoint, with a ring buffer of recent output to
+// replay to clients when they attach.
+struct Session {
+  int master, listener;
+  int clients[SESSION_CLIENTS_MAX];
+  size_t scrollbackEnd; // Total bytes of output
+  char scrollback[SCROLLBACK_SIZE];
+  size_t inputLen;
+  char input[SESSION_INPUT_SIZE];
+};
+
+static struct Session *sessions[SESSIONS_MAX];
+
+void sessionDropClient(struct Session *session, int client) {
+  close(session->clients[client]);
+  session->clients[client] = -1;
+}
+
+void sessionEnd(int index) {
+  struct Session *session = sessions[index];
+  struct sockaddr_un address;
+  socklen_t addressLen = sizeof(address);
+  if (!getsockname(session->listener, (struct sockaddr *)&address,
+                   &addressLen) &&
+      addressLen > sizeof(sa_family_t)) {
+    unlink(address.sun_path);
+  }
+
+  for (int c = 0; c < SESSION_CLIENTS_MAX; ++c) {
+    if (session->clients[c] != -1) {
+      sessionDropClient(session, c);
+    }
+  }
+  close(session->master);
+  close(session->listener);
+  free(session);
+  sessions[index] = 0;
+}
+
+// Receives a session from sessionCreate over the control socket.
+void sessionReceive(int control) {
+  int connection = accept4(control, 0, 0, SOCK_CLOEXEC);
+  if (connection == -1) {
+    return;
+  }
+  // Do not let a stuck client block the entrypoint
+  struct timeval timeout = {.tv_sec = 1};
+  setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  int fds[2];
+  char controlBuffer[CMSG_SPACE(sizeof(fds))];
+  char data;
+  struct iovec iov = {.iov_base = &data, .iov_len = 1};
+  struct msghdr message = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+      .msg_control = controlBuffer,
+      .msg_controllen = sizeof(controlBuffer),
+  };
+  char ack = 0;
+  struct cmsghdr *cmsg;
+  if (recvmsg(connection, &message, MSG_CMSG_CLOEXEC) == 1 &&
+      (cmsg = CMSG_FIRSTHDR(&message)) && cmsg->cmsg_level == SOL_SOCKET &&
+      cmsg->cmsg_type == SCM_RIGHTS &&
+      cmsg->cmsg_len == CMSG_LEN(sizeof(fds))) {
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+    int index = 0;
+    while (index < SESSIONS_MAX && sessions[index]) {
+      ++index;
+    }
+    struct Session *session =
+        index < SESSIONS_MAX ? malloc(sizeof(struct Session)) : 0;
+    if (session) {
+      // The pty may not take input while its program isn't reading, and
+      // writing to it must not stall everything else.
+      fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+      session->master = fds[0];
+      session->listener = fds[1];
+      for (int c = 0; c < SESSION_CLIENTS_MAX; ++c) {
+        session->clients[c] = -1;
+      }
+      session->scrollbackEnd = 0;
+      session->inputLen = 0;
+      sessions[index] = session;
+      ack = 1;
+    } else {
+      close(fds[0]);
+      close(fds[1]);
+    }
+  }
+
+  send(connection, &ack, 1, MSG_NOSIGNAL);
+  close(connection);
+}
+
+// Sends data to a client without blocking, dropping clients that fall behind.
+void sessionSend(struct Session *session, int client, char *data, size_t len) {
+  if (send(session->clients[client], data, len, MSG_NOSIGNAL | MSG_DONTWAIT) !=
+      (ssize_t)len) {
+    sessionDropClient(session, client);
+  }
+}
+
+void sessionAccept(struct Session *session) {
+  int client = accept4(session->listener, 0, 0, SOCK_CLOEXEC);
+  if (client == -1) {
+    return;
+  }
+
+  int c = 0;
+  while (c < SESSION_CLIENTS_MAX && session->clients[c] != -1) {
+    ++c;
+  }
+  if (c == SESSION_CLIENTS_MAX) {
+    close(client);
+    return;
+  }
+  session->clients[c] = client;
+
+  // Replay the scrollback
+  size_t start = session->scrollbackEnd > SCROLLBACK_SIZE
+                     ? session->scrollbackEnd - SCROLLBACK_SIZE
+                     : 0;
+  while (start < session->scrollbackEnd && session->clients[c] != -1) {
+    size_t at = start % SCROLLBACK_SIZE;
+    size_t len = session->scrollbackEnd - start;
+    if (len > SCROLLBACK_SIZE - at) {
+      len = SCROLLBACK_SIZE - at;
+    }
+    if (len > 4096) {
+      len = 4096;
+    }
+    sessionSend(session, c, session->scrollback + at, len);
+    start += len;
+  }
+}
+
+// Returns -1 if the session has ended
+int sessionOutput(struct Session *session) {
+  char buffer[4096];
+  ssize_t n = read(session->master, buffer, sizeof(buffer));
+  if (n == -1 && (errno == EAGAIN || errno == EINTR)) {
+    return 0;
+  }
+  if (n <= 0) {
+    return -1;
+  }
+
+  for (ssize_t written = 0; written < n;) {
+    size_t at = session->scrollbackEnd % SCROLLBACK_SIZE;
+    size_t len = n - written;
+    if (len > SCROLLBACK_SIZE - at) {
+      len = SCROLLBACK_SIZE - at;
+    }
+    memcpy(session->scrollback + at, buffer + written, len);
+    session->scrollbackEnd += len;
+    written += len;
+  }
+
+  for (int c = 0; c < SESSION_CLIENTS_MAX; ++c) {
+    if (session->clients[c] != -1) {
+      sessionSend(session, c, buffer, n);
+    }
+  }
+  return 0;
+}
+
+// Writes as much pending input to the pty as it takes without blocking.
+void sessionFlushInput(struct Session *session) {
+  ssize_t n;
+  while (session->inputLen &&
+         ((n = write(session->master, session->input, session->inputLen)) >
+              0 ||
+          (n == -1 && errno == EINTR))) {
+    if (n > 0) {
+      session->inputLen -= n;
+      memmove(session->input, session->input + n, session->inputLen);
+    }
+  }
+  if (session->inputLen && errno != EAGAIN) {
+    session->inputLen = 0; // The pty is gone; sessionOutput ends the session
+  }
+}
+
+// Clients are only read from while there is room for a whole message, so
+// they wait when the pty is not taking input instead of losing it.
+bool sessionTakesInput(struct Session *session) {
+  return SESSION_INPUT_SIZE - session->inputLen >= SESSION_MESSAGE_MAX - 1;
+}
+
+void sessionInput(struct Session *session, int client) {
+  // Several clients may have been polled with room for only one message, so
+  // the others are left queued in their sockets until the pty catches up.
+  if (!sessionTakesInput(session)) {
+    return;
+  }
+  char buffer[SESSION_MESSAGE_MAX];
+  ssize_t n = recv(session->clients[client], buffer, sizeof(buffer), 0);
+  if (n <= 0) {
+    sessionDropClient(session, client);
+  } else if (buffer[0] == 'i') {
+    memcpy(session->input + session->inputLen, buffer + 1, n - 1);
+    session->inputLen += n - 1;
+    sessionFlushInput(session);
+  } else if (buffer[0] == 'w' && n == sizeof(struct winsize) + 1) {
+    struct winsize size;
+    memcpy(&size, buffer + 1, sizeof(size));
+    ioctl(session->master, TIOCSWINSZ, &size);
+  }
+}
+
+// Waits for activity on the sessions and logged output, and handles it.
+// Signals in waitMask are blocked except while waiting.
+void entrypointServe(int control, const sigset_t *waitMask) {
+  struct pollfd
+      fds[1 + SESSIONS_MAX * (2 + SESSION_CLIENTS_MAX) + LOG_SOURCES_MAX];
+  // Which session and client each of fds is for
+  struct {
+    int session, client; // client is -1 for the master, -2 for the listener
+  } owners[sizeof(fds) / sizeof(*fds)];
+
+  int count = 0;
+  fds[count++] = (struct pollfd){.fd = control, .events = POLLIN};
+  // Log sources come first, with a session of -1
+  for (int l = 0; l < logSourceCount; ++l) {
+    owners[count].session = -1;
+    owners[count].client = l;
+    fds[count++] = (struct pollfd){.fd = logSources[l].fd, .events = POLLIN};
+  }
+  for (int s = 0; s < SESSIONS_MAX; ++s) {
+    struct Session *session = sessions[s];
+    if (!session) {
+      continue;
+    }
+    owners[count].session = s;
+    owners[count].client = -1;
+    fds[count++] = (struct pollfd){
+        .fd = session->master,
+        .events = POLLIN | (session->inputLen ? POLLOUT : 0)};
+    owners[count].session = s;
+    owners[count].client = -2;
+    fds[count++] = (struct pollfd){.fd = session->listener, .events = POLLIN};
+    for (int c = 0; c < SESSION_CLIENTS_MAX && sessionTakesInput(session);
+         ++c) {
+      if (session->clients[c] != -1) {
+        owners[count].session = s;
+        owners[count].client = c;
+        fds[count++] =
+            (struct pollfd){.fd = session->clients[c], .events = POLLIN};
+      }
+    }
+  }
+
+  if (ppoll(fds, count, 0, waitMask) <= 0) {
+    return;
+  }
+
+  // Removing a log source moves the last one into its place, so go backwards.
+  // Sessions still start after all the polled log sources in fds.
+  int polledLogSources = logSourceCount;
+  for (int i = polledLogSources; i > 0; --i) {
+    if (fds[i].revents) {
+      logRead(owners[i].client);
+    }
+  }
+
+  for (int i = polledLogSources + 1; i < count; ++i) {
+    struct Session *session = sessions[owners[i].session];
+    // The session may have ended while handling an earlier fd
+    if (!fds[i].revents || !session) {
+      continue;
+    }
+    if (owners[i].client == -1) {
+      if (fds[i].revents & POLLOUT) {
+        sessionFlushInput(session);
+      }
+      if (fds[i].revents != POLLOUT && sessionOutput(session)) {
+        sessionEnd(owners[i].session);
+      }
+    } else if (owners[i].client == -2) {
+      sessionAccept(session);
+    } else if (session->clients[owners[i].client] == fds[i].fd) {
+      sessionInput(session, owners[i].client);
+    }
+  }
+
+  // New sessions are added last so they do not shift the indices above.
+  if (fds[0].revents) {
+    sessionReceive(control);
+  }
+}
+
+// Returns the path where a suspended container's checkpoint is kept.
+// Returned pointer must be freed
+char *checkpointPath(char *container) {
+  char *relPath = concat("checkpoints/", container, ".tar.zst", (char *)0);
+  char *path = dataPath(relPath);
+  free(relPath);
+  return path;
+}
+
+// Checks that the manager can checkpoint and restore containers, which
+// rootless podman refuses to do.
+int checkpointSupported(struct Flags flags) {
+  char rootless[16];
+  char *argv[] = {flags.manager, "info", "--format",
+                  "{{.Host.Security.Rootless}}", 0};
+  if (captureCommand(argv, rootless, sizeof(rootless))) {
+    fputs("Failed to get information from the container manager.\n", stderr);
+    return EX_UNAVAILABLE;
+  }
+  if (!strncmp(rootless, "true", 4)) {
+    fputs("Suspending needs CRIU, which rootless podman can't use. Only "
+          "containers created by running dizzybox as root, with "
+          "XDG_RUNTIME_DIR kept, can be suspended.\n",
+          stderr);
+    return EX_NOPERM;
+  }
+  return 0;
+}
+
+// Checkpoints a running container into a compressed archive and removes it,
+// freeing all of its memory. The archive includes the container's
+// configuration and filesystem changes, so containerResume recreates it.
+int containerSuspend(struct Flags flags) {
+  if (flags.runtime) {
+    fputs("Suspending is only supported with podman.\n", stderr);
+    return EX_UNAVAILABLE;
+  }
+
+  char *path = checkpointPath(flags.container);
+  if (!access(path, F_OK)) {
+    fprintf(stderr, "%s is already suspended.\n", flags.container);
+    free(path);
+    return 0;
+  }
+
+  // Daemons must not be told to prepare for a checkpoint that can't happen
+  int exitCode = checkpointSupported(flags);
+  if (exitCode) {
+    free(path);
+    return exitCode;
+  }
+
+  char *dir = dataPath("checkpoints");
+  exitCode = flags.dryRun ? 0 : makeDirs(dir);
+  free(dir);
+  if (exitCode) {
+    free(path);
+    return exitCode;
+  }
+
+  // Lets daemons prepare, e.g. by closing connections to the host.
+  char *hookArgv[] = {flags.manager,
+                      "exec",
+                      flags.container,
+                      "/bin/sh",
+                      "-c",
+                      "[ ! -x /etc/checkpoint.sh ] || exec /etc/checkpoint.sh",
+                      0};
+  if (runCommand(flags, hookArgv)) {
+    fputs("Warning: /etc/checkpoint.sh failed.\n", stderr);
+  }
+
+  char *exportArg = concat("--export=", path, (char *)0);
+  char *checkpointArgv[] = {flags.manager,     "container",
+                            "checkpoint",      exportArg,
+                            "--compress=zstd", "--tcp-established",
+                            flags.container,   0};
+  exitCode = runCommand(flags, checkpointArgv);
+  free(exportArg);
+  if (exitCode) {
+    fprintf(stderr, "Failed to checkpoint %s.\n", flags.container);
+    unlink(path);
+    free(path);
+    return exitCode;
+  }
+
+  char *rmArgv[] = {flags.manager, "rm", flags.container, 0};
+  exitCode = runCommand(flags, rmArgv);
+  free(path);
+  return exitCode;
+}
+
+// Restores a container suspended by containerSuspend, if it is suspended.
+int containerResume(struct Flags flags) {
+  char *path = checkpointPath(flags.container);
+  if (access(path, F_OK)) {
+    free(path);
+    return 0;
+  }
+
+  int exitCode = checkpointSupported(flags);
+  if (exitCode) {
+    free(path);
+    return exitCode;
+  }
+
+  char *importArg = concat("--import=", path, (char *)0);
+  char *restoreArgv[] = {flags.manager, "container",         "restore",
+                         importArg,     "--tcp-established", 0};
+  exitCode = runCommand(flags, restoreArgv);
+  free(importArg);
+  if (exitCode) {
+    fprintf(stderr,
+            "Failed to restore %s. The checkpoint is kept in %s.\n",
+            flags.container, path);
+    free(path);
+    return exitCode;
+  }
+
+  if (!flags.dryRun) {
+    unlink(path);
+  }
+  free(path);
+
+  // Tell the entrypoint to run /etc/restore.sh
+  char *killArgv[] = {flags.manager, "kill", "--signal=USR2", flags.container,
+                      0};
+  return runCommand(flags, killArgv);
+}
+
+int containerStart(struct Flags flags) {
+  if (flags.runtime) {
+    return ociStart(flags);
+  }
+
+  char *suspended = checkpointPath(flags.container);
+  bool isSuspended = !access(suspended, F_OK);
+  free(suspended);
+  if (isSuspended) {
+    return containerResume(flags);
+  }
+
+  char *argv[] = {flags.manager, "start", flags.container, 0};
+  if (flags.dryRun) {
+    printCommand(argv);
+    return 0;
+  }
+
+  int childPid = fork();
+  if (childPid) {
+    int stat;
+    waitpid(childPid, &stat, 0);
+    return stat;
+  } else {
+    int err = execvp(flags.manager, argv);
+    exit(err);
+  }
+}
+
+// Returns the path of the file whose mtime is when a container was last
+// entered.
+// Returned pointer must be freed
+char *stampPath(char *container) {
+  char *relPath = concat("stamps/", container, (char *)0);
+  char *path = dataPath(relPath);
+  free(relPath);
+  return path;
+}
+
+// Records that a container is being entered, for gc --idle.
+void stampEntered(struct Flags flags) {
+  if (flags.dryRun) {
+    return;
+  }
+
+  char *dir = dataPath("stamps");
+  char *path = stampPath(flags.container);
+  int fd = makeDirs(dir) ? -1
+                         : open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+  if (fd == -1 || futimens(fd, 0)) {
+    fprintf(stderr, "Warning: Failed to update %s.\n", path);
+  }
+  if (fd != -1) {
+    close(fd);
+  }
+  free(path);
+  free(dir);
+}
+
+// Starts a container through the activation socket set up by autostart
+// --socket, so that systemd starts it as it would at login. Returns -1 if
+// there is no activation socket or the container did not come up in time.
+int activateContainer(char *container) {
+  char *runtimeDir = getenv("XDG_RUNTIME_DIR");
+  if (!runtimeDir) {
+    return -1;
+  }
+
+  struct sockaddr_un address = {.sun_family = AF_UNIX};
+  if (snprintf(address.sun_path, sizeof(address.sun_path),
+               "%s/dizzybox/activate/%s.sock", runtimeDir,
+               container) >= (int)sizeof(address.sun_path)) {
+    return -1;
+  }
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    return -1;
+  }
+  if (connect(fd, (struct sockaddr *)&address, sizeof(address))) {
+    close(fd);
+    return -1;
+  }
+
+  // dizzybox start closes the connection once the container is up. The
+  // socket unit may have given up after failures, so don't wait forever.
+  struct timeval timeout = {.tv_sec = 120};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  char byte;
+  ssize_t n;
+  while ((n = read(fd, &byte, 1)) == -1 && errno == EINTR)
+    ;
+  close(fd);
+  return n ? -1 : 0;
+}
+
+int containerEnter(struct Flags flags) {
+  int result;
+
+  // strcmp is not used because we want to check if it is manually set
+  if (flags.image != defaultFlags.image || flags.imageArchive) {
+    result = containerCreate(flags);
+    if (result) {
+      return result;
+    }
+  }
+
+  if (flags.detach && !flags.session) {
+    fputs("--detach needs a session to be named with --attach.\n", stderr);
+    return EX_USAGE;
+  }
+
+  char *session = 0;
+  if (flags.session) {
+    if (!(session = sessionPath(flags.container, flags.session))) {
+      return EX_CONFIG;
+    }
+
+    // Reattaching needs neither the manager nor a login
+    int fd = flags.dryRun ? -1 : sessionConnect(session);
+    if (fd != -1) {
+      free(session);
+      if (flags.detach) {
+        close(fd);
+        fprintf(stderr, "The session %s is already running.\n", flags.session);
+        return 0;
+      }
+      return sessionAttach(fd);
+    }
+  }
+
+  // Exported desktop entries come through here too, so they also start the
+  // container through its activation socket.
+  result = !flags.dryRun && !activateContainer(flags.container)
+               ? 0
+               : containerStart(flags);
+  if (result) {
+    free(session);
+    return result;
+  }
+  stampEntered(flags);
+
+  char *cwd;
+  for (int cwdCap = 1024;; cwdCap *= 2) {
+    cwd = checkedMalloc(sizeof(char) * cwdCap);
+    if (getcwd(cwd, cwdCap)) {
+      break;
+    }
+    free(cwd);
+  }
+
+  // TODO: Figure out a more appropriate size
+  const int managerArgsMax = 100;
+  char **argv =
+      checkedMalloc(sizeof(char *) * (flags.argc + managerArgsMax + 1));
+
+  int containerLen = strlen(flags.container);
+  char *containerArg = checkedMalloc(sizeof("CONTAINER_ID=") + containerLen);
+  memcpy(containerArg, "CONTAINER_ID=", sizeof("CONTAINER_ID=") - 1);
+  memcpy(containerArg + sizeof("CONTAINER_ID=") - 1, flags.container,
+         containerLen + 1);
+
+  int argc = 0;
+  char *homeArg = 0;
+  char userArg[64];
+  if (flags.runtime) {
+    // OCI runtimes only take numeric ids and do not look up the home.
+    struct passwd *pwuid = getpwuid(getuid());
+    if (!pwuid) {
+      fputs("Failed to get user home information.\n", stderr);
+      return EX_CONFIG;
+    }
+    homeArg = concat("HOME=", flags.su ? "/root" : pwuid->pw_dir, (char *)0);
+    snprintf(userArg, sizeof(userArg), "%lu:%lu",
+             flags.su ? 0ul : (unsigned long)pwuid->pw_uid,
+             flags.su ? 0ul : (unsigned long)pwuid->pw_gid);
+
+    argv[argc++] = flags.runtime;
+    argv[argc++] = "exec";
+    if (isatty(STDIN_FILENO)) {
+      argv[argc++] = "--tty";
+    }
+    argv[argc++] = "--cwd";
+    argv[argc++] = cwd;
+    argv[argc++] = "--env";
+    argv[argc++] = homeArg;
+  } else {
+    argv[argc++] = flags.manager;
+    argv[argc++] = "exec";
+    argv[argc++] = "-it";
+    argv[argc++] = "--workdir";
+    argv[argc++] = cwd;
+  }
+  argv[argc++] = "--env";
+  argv[argc++] = containerArg;
+
+  argv[argc++] = "-u";
+  if (flags.runtime) {
+    argv[argc++] = userArg;
+  } else if (flags.su) {
+    argv[argc++] = "root";
+  } else {
+    argv[argc++] = getlogin();
+  }
+
+  // Track all of the strings that are allocated in the loop
+  void *mustFree[sizeof(sharedEnv) / sizeof(*sharedEnv)];
+  void **freeTop = mustFree;
+
+  for (char **env = sharedEnv; *env; ++env) {
+    char *envVar = *env;
+    char *value = getenv(envVar);
+    if (value) {
+      size_t envVarLen = strlen(envVar);
+      size_t valueLen = strlen(value);
+
+      char *envArg = checkedMalloc(sizeof(char) * (envVarLen + valueLen + 2));
+      *freeTop++ = envArg;
+
+      memcpy(envArg, envVar, envVarLen);
+      envArg[envVarLen] = '=';
+      memcpy(envArg + envVarLen + 1, value, valueLen + 1);
+
+      argv[argc++] = "-e";
+      argv[argc++] = envArg;
+    }
+  }
+
+  char *sessionArg = 0;
+  if (session) {
+    // The entrypoint starts the session and runs the command in it
+    sessionArg = concat("DIZZYBOX_SESSION=", session, (char *)0);
+    argv[argc++] = "-e";
+    argv[argc++] = sessionArg;
+    if (flags.detach) {
+      argv[argc++] = "-e";
+      argv[argc++] = "DIZZYBOX_DETACH=1";
+    }
+  }
+
+  argv[argc++] = flags.container;
+  if (session) {
+    argv[argc++] = ENTRYPOINT;
+  }
+
+  memcpy(argv + argc, flags.argv, sizeof(char *) * (flags.argc + 1));
+  if (flags.dryRun) {
+    printCommand(argv);
+    result = 0;
+  } else {
+    execvp(argv[0], argv);
+
+    fputs("Failed to exec", stderr);
+    result = EX_OSERR;
+  }
+
+  while (freeTop-- > mustFree) {
+    free(*freeTop);
+  }
+  free(containerArg);
+  free(homeArg);
+  free(sessionArg);
+  free(session);
+  free(argv);
+  free(cwd);
+
+  return result;
+}
+
+int containerRemove(struct Flags flags) {
+  if (flags.runtime) {
+    return ociRemove(flags);
+  }
+
+  // A suspended container only exists as its checkpoint
+  char *suspended = checkpointPath(flags.container);
+  if (!access(suspended, F_OK)) {
+    char *rmArgv[] = {"rm", suspended, 0};
+    int exitCode = runCommand(flags, rmArgv);
+    free(suspended);
+    return exitCode;
+  }
+  free(suspended);
+
+  char *argv[] = {flags.manager, "rm", flags.container, 0};
+  return execvp(flags.manager, argv);
+}
+
+// Export a desktop file.
+// Not implemented: XDG_DATA_DIRS, icon
+int exportDesktopEntry(struct Flags flags, char *fileName) {
+  char *containerId = getenv("CONTAINER_ID");
+  if (!containerId) {
+    puts("Failed to get container ID. $CONTAINER_ID must be set.");
+    return EX_CONFIG;
+  }
+
+  // Get the base name of the file
+  char *baseName = fileName;
+  for (int i = strlen(fileName); i-- > 0;) {
+    if (fileName[i] == '/') {
+      baseName = fileName + i + 1;
+      break;
+    }
+  }
+
+  struct passwd *pwuid = getpwuid(getuid());
+  if (!pwuid) {
+    fputs("Could not find you\n", stderr);
+    return EX_NOUSER;
+  }
+  char *home = pwuid->pw_dir;
+  int homeLen = strlen(home);
+  if (home[homeLen - 1] == '/') {
+    --homeLen;
+  }
+
+  FILE *sourceFile = fopen(fileName, "r");
+  if (!sourceFile) {
+    fprintf(stderr, "Failed to open %s for reading.\n", fileName);
+    return EX_DATAERR;
+  }
+
+  FILE *destinationFile; // File to write to
+  if (flags.dryRun) {
+    destinationFile = stdout;
+  } else {
+    // destPath = `${home}/.local/share/applications/dizzybox-${baseName}`
+    const char relBaseName[] = "/.local/share/applications/dizzybox-";
+    int baseLen = strlen(baseName);
+    char *destPath = malloc(homeLen + baseLen + sizeof(relBaseName) +
+                            sizeof("/run/host") - 1);
+    char *pathTail = destPath;
+    memcpy(pathTail, "/run/host", sizeof("/run/host") - 1);
+    memcpy(pathTail += sizeof("/run/host") - 1, home, homeLen);
+    memcpy(pathTail += homeLen, relBaseName, sizeof(relBaseName));
+    strcpy(pathTail += sizeof(relBaseName) - 1, baseName);
+
+    // File is opened in append to avoid clobber
+    destinationFile = fopen(destPath, "a");
+    if (!destinationFile) {
+      fclose(sourceFile);
+      fprintf(stderr, "Destination file %s could not be created.\n", destPath);
+      free(destPath);
+      return EX_CANTCREAT;
+    }
+
+    // Verify that we are writing to an empty file
+    struct stat destInfo;
+    if (fstat(fileno(destinationFile), &destInfo)) {
+      fclose(sourceFile);
+      fclose(destinationFile);
+      fprintf(stderr, "Failed to retrieve the file information for %s.\n",
+              destPath);
+      free(destPath);
+      return EX_DATAERR;
+    };
+
+    if (destInfo.st_size) {
+      fclose(sourceFile);
+      fclose(destinationFile);
+      fprintf(stderr, "Refusing to clobber non-empty file %s.\n", destPath);
+      free(destPath);
+      return EX_DATAERR;
+    }
+  }
+
+  enum {
+    stateStartLine,
+    stateWriting,
+    stateDiscard,
+    stateE,
+    stateEx,
+    stateExe,
+    stateExec,
+    stateExecWhitespace,
+    stateT,
+    stateTr,
+    stateTry,
+    stateTryE,
+    stateTryEx,
+    stateTryExe,
+    stateTryExec,
+  } state = stateStartLine;
+  static char const *const tryExecStr = "TryExec";
+  static char const *const execStr = "Exec";
+  for (;;) {
+    int next = fgetc(sourceFile);
+    if (next == EOF) {
+      break;
+    }
+    // TODO: Add error checking to writes
+    switch (state) {
+    case stateStartLine:
+      if (next == 'E') {
+        state = stateE;
+        break;
+      }
+      if (next == 'T') {
+        state = stateT;
+        break;
+      }
+      state = stateWriting;
+      // Fallthrough
+    case stateWriting:
+      fputc(next, destinationFile);
+      if (next == '\n') {
+        state = stateStartLine;
+      }
+      break;
+    case stateDiscard:
+      if (next == '\n') {
+        fputc(next, destinationFile);
+        state = stateStartLine;
+      }
+      break;
+    case stateE:
+    case stateEx:
+    case stateExe:
+      if (next == execStr[++state - stateE]) {
+        break;
+      }
+      {
+        char const *const end = execStr + state - stateE;
+        for (char const *p = execStr; p < end; ++p)
+          fputc(*p, destinationFile);
+      }
+      fputc(next, destinationFile);
+      state = next == '\n' ? stateStartLine : stateWriting;
+      break;
+    case stateExec:
+      fputs(execStr, destinationFile);
+      state = stateExecWhitespace;
+      // Fallthrough
+    case stateExecWhitespace:
+      fputc(next, destinationFile);
+      if (next == ' ') {
+        break;
+      }
+      if (next == '=') {
+        fputs("dizzybox enter ", destinationFile);
+        // Podman's rules are strict enough to not need escaping.
+        fputs(containerId, destinationFile);
+        fputc(' ', destinationFile);
+        if (flags.shell) {
+          fputs("/usr/bin/entrypoint -l -c 'exec \"$@\"' -- ", destinationFile);
+        }
+        state = stateWriting;
+        break;
+      }
+      if (next == '\n') {
+        state = stateStartLine;
+      } else {
+        state = stateWriting;
+      }
+      break;
+    case stateT:
+    case stateTr:
+    case stateTry:
+    case stateTryE:
+    case stateTryEx:
+    case stateTryExe:
+      if (next == tryExecStr[++state - stateT]) {
+        break;
+      }
+      {
+        char const *const end = tryExecStr + state - stateT;
+        for (char const *p = tryExecStr; p < end; ++p)
+          fputc(*p, destinationFile);
+      }
+      fputc(next, destinationFile);
+      state = next == '\n' ? stateStartLine : stateWriting;
+      break;
+    case stateTryExec:
+      if (next == ' ' || next == '=') {
+        state = stateDiscard;
+        break;
+      }
+      fputs(tryExecStr, destinationFile);
+      state = stateWriting;
+      break;
+    }
+  }
+
+  int err = ferror(sourceFile);
+  fclose(destinationFile);
+  fclose(sourceFile);
+  if (err) {
+    fputs("Warning: Potentially partial write", stderr);
+    return EX_DATAERR;
+  }
+  return 0;
+}
+
+int export(struct Flags flags) {
+  int result;
+  char **end = flags.argv + flags.argc;
+  for (char **p = flags.argv; p < end; p++) {
+    if ((result = exportDesktopEntry(flags, *p))) {
+      return result;
+    }
+  }
+  return 0;
+}
+
+// A container made by dizzybox create, as found by managedContainers.
+struct ManagedContainer {
+  char *name, *image, *imageId, *upperDir; // Point into the inspect output
+  time_t created, entered;                 // entered is 0 if never entered
+  bool running, remove;
+  unsigned long long size; // Of the writable layer
+};
+
+// An image used by managed containers, whose size they share.
+struct ManagedImage {
+  char *name, *id;
+  unsigned long long size;
+  int containers, kept; // kept is the number not being removed
+  bool removable;       // Made by dizzybox or untagged, so gc may remove it
+};
+
+static unsigned long long layerSize;
+
+int layerVisit(const char *path, const struct stat *info, int type,
+               struct FTW *ftw) {
+  (void)path, (void)type, (void)ftw;
+  layerSize += (unsigned long long)info->st_blocks * 512;
+  return 0;
+}
+
+// Finds the containers made by dizzybox, along with their images and how
+// much space they take. Must be run in the manager's user namespace to read
+// the writable layers. Returns the number of containers, or -1. *output must
+// be freed, since the names point into it.
+int managedContainers(struct Flags flags, char **output,
+                      struct ManagedContainer containers[MANAGED_MAX],
+                      struct ManagedImage images[MANAGED_MAX],
+                      int *imageCount) {
+  *imageCount = 0;
+  *output = checkedMalloc(MANAGED_MAX * 1024);
+
+  char *psArgv[] = {flags.manager, "ps",       "--all",       "--filter",
+                    ("label=" MANAGED_LABEL), "--format", "{{.Names}}", 0};
+  if (captureCommand(psArgv, *output, MANAGED_MAX * 1024)) {
+    fputs("Failed to list containers.\n", stderr);
+    return -1;
+  }
+
+  char *inspectArgv[MANAGED_MAX + 6] = {
+      flags.manager, "container", "inspect", "--format",
+      "{{.Name}}\t{{.ImageName}}\t{{.Image}}\t{{.Created.Unix}}\t"
+      "{{.State.Running}}\t{{.GraphDriver.Data.UpperDir}}"};
+  int argc = 5;
+  for (char *name = strtok(*output, "\n"); name && argc < MANAGED_MAX + 5;
+       name = strtok(0, "\n")) {
+    inspectArgv[argc++] = name;
+  }
+  inspectArgv[argc] = 0;
+  if (argc == 5) {
+    return 0;
+  }
+
+  char *details = checkedMalloc(MANAGED_MAX * 1024);
+  if (captureCommand(inspectArgv, details, MANAGED_MAX * 1024)) {
+    fputs("Failed to inspect containers.\n", stderr);
+    free(details);
+    return -1;
+  }
+  free(*output);
+  *output = details;
+
+  int count = 0;
+  char *line, *lineEnd;
+  for (line = strtok_r(details, "\n", &lineEnd); line && count < MANAGED_MAX;
+       line = strtok_r(0, "\n", &lineEnd)) {
+    char *fields[6];
+    int fieldCount = 0;
+    for (char *field = line; fieldCount < 6; ++fieldCount) {
+      fields[fieldCount] = field;
+      if (!(field = strchr(field, '\t'))) {
+        ++fieldCount;
+        break;
+      }
+      *field++ = 0;
+    }
+    if (fieldCount != 6) {
+      continue;
+    }
+
+    struct ManagedContainer *container = containers + count++;
+    *container = (struct ManagedContainer){
+        .name = fields[0],
+        .image = fields[1],
+        .imageId = fields[2],
+        .upperDir = fields[5],
+        .created = strtoll(fields[3], 0, 10),
+        .running = !strcmp(fields[4], "true"),
+    };
+
+    char *stamp = stampPath(container->name);
+    struct stat info;
+    if (!stat(stamp, &info)) {
+      container->entered = info.st_mtime;
+    }
+    free(stamp);
+
+    // Other storage drivers have no UpperDir to measure
+    if (*container->upperDir == '/') {
+      layerSize = 0;
+      nftw(container->upperDir, layerVisit, 16, FTW_PHYS);
+      container->size = layerSize;
+    }
+
+    int i = 0;
+    while (i < *imageCount && strcmp(images[i].id, container->imageId)) {
+      ++i;
+    }
+    if (i == *imageCount) {
+      images[(*imageCount)++] =
+          (struct ManagedImage){.name = container->image,
+                                .id = container->imageId};
+      char details[4096];
+      char *detailsArgv[] = {flags.manager,
+                             "image",
+                             "inspect",
+                             "--format",
+                             "{{.Size}}\t{{range .RepoTags}}{{.}} {{end}}",
+                             container->imageId,
+                             0};
+      if (!captureCommand(detailsArgv, details, sizeof(details))) {
+        char *tags;
+        images[i].size = strtoull(details, &tags, 10);
+        images[i].removable = !tags[strspn(tags, "\t\n ")] ||
+                              strstr(tags, "localhost/dizzybox-");
+      }
+    }
+    ++images[i].containers;
+    ++images[i].kept;
+  }
+  return count;
+}
+
+// Reports how much space containers made by dizzybox take.
+int diskUsage(struct Flags flags) {
+  if (needsUnshare()) {
+    return unshareSelf(flags, "du");
+  }
+
+  char *output;
+  struct ManagedContainer containers[MANAGED_MAX];
+  struct ManagedImage images[MANAGED_MAX];
+  int imageCount;
+  int count =
+      managedContainers(flags, &output, containers, images, &imageCount);
+  if (count == -1) {
+    free(output);
+    return EX_UNAVAILABLE;
+  }
+
+  unsigned long long total = 0;
+  printf("%-24s %12s  %-12s %s\n", "CONTAINER", "SIZE", "LAST ENTERED",
+         "IMAGE");
+  for (int i = 0; i < count; ++i) {
+    char entered[16] = "never";
+    if (containers[i].running) {
+      strcpy(entered, "running");
+    } else if (containers[i].entered) {
+      strftime(entered, sizeof(entered), "%Y-%m-%d",
+               localtime(&containers[i].entered));
+    }
+    printf("%-24s %8.1f MiB  %-12s %s\n", containers[i].name,
+           containers[i].size / 1048576.0, entered, containers[i].image);
+    total += containers[i].size;
+  }
+
+  printf("\n%-24s %12s  %s\n", "IMAGE", "SIZE", "CONTAINERS");
+  for (int i = 0; i < imageCount; ++i) {
+    printf("%-24s %8.1f MiB  %d\n", images[i].name, images[i].size / 1048576.0,
+           images[i].containers);
+    total += images[i].size;
+  }
+  printf("\nTotal: %.1f MiB\n", total / 1048576.0);
+
+  free(output);
+  return 0;
+}
+
+time_t lastUsed(const struct ManagedContainer *container) {
+  return container->entered ? container->entered : container->created;
+}
+
+// Marks a container's image as no longer used by it. Returns the space that
+// removing both frees, counting the image only if gc would remove it.
+unsigned long long releaseContainer(const struct ManagedContainer *container,
+                                    struct ManagedImage *images,
+                                    int imageCount) {
+  unsigned long long size = container->size;
+  for (int i = 0; i < imageCount; ++i) {
+    if (!strcmp(images[i].id, container->imageId) && !--images[i].kept &&
+        images[i].removable) {
+      size += images[i].size;
+    }
+  }
+  return size;
+}
+
+// Runs the commands, up to GC_JOBS at a time. Returns how many failed.
+int runParallel(struct Flags flags, char **commands[], int count) {
+  if (flags.dryRun) {
+    for (int i = 0; i < count; ++i) {
+      printCommand(commands[i]);
+    }
+    return 0;
+  }
+
+  int failed = 0, running = 0;
+  for (int next = 0; next < count || running;) {
+    if (next < count && running < GC_JOBS) {
+      if (spawnCommand(commands[next++], -1, -1) == -1) {
+        ++failed;
+      } else {
+        ++running;
+      }
+      continue;
+    }
+
+    int stat;
+    if (wait(&stat) == -1) {
+      break;
+    }
+    --running;
+    failed += !!stat;
+  }
+  return failed;
+}
+
+// Returns a newline separated list of every container, including ones not
+// made by dizzybox create, ones run by OCI runtimes and suspended ones.
+// Returns null if the list may not be complete.
+// Returned pointer must be freed
+char *knownContainers(struct Flags flags) {
+  size_t cap = MANAGED_MAX * 1024;
+  char *list = checkedMalloc(cap);
+  char *psArgv[] = {flags.manager, "ps", "--all", "--format", "{{.Names}}", 0};
+  // A full buffer may have cut the list short
+  if (captureCommand(psArgv, list, cap) || strlen(list) >= cap - 256) {
+    free(list);
+    return 0;
+  }
+
+  char *dirs[] = {dataPath("oci"), dataPath("checkpoints")};
+  for (size_t i = 0; i < sizeof(dirs) / sizeof(*dirs); ++i) {
+    DIR *dir = opendir(dirs[i]);
+    for (struct dirent *entry; dir && (entry = readdir(dir));) {
+      size_t len = strlen(list), nameLen = strlen(entry->d_name);
+      if (*entry->d_name == '.' || len + nameLen + 2 > cap) {
+        continue;
+      }
+      // Checkpoints are NAME.tar.zst
+      if (i && nameLen > 8 &&
+          !strcmp(entry->d_name + nameLen - 8, ".tar.zst")) {
+        nameLen -= 8;
+      }
+      snprintf(list + len, cap - len, "%.*s\n", (int)nameLen, entry->d_name);
+    }
+    if (dir) {
+      closedir(dir);
+    }
+    free(dirs[i]);
+  }
+  return list;
+}
+
+bool isKnownContainer(char *list, char *name, size_t nameLen) {
+  for (char *line = list; *line; line += strcspn(line, "\n") + 1) {
+    if (strcspn(line, "\n") == nameLen && !strncmp(line, name, nameLen)) {
+      return true;
+    }
+    if (!line[strcspn(line, "\n")]) {
+      break;
+    }
+  }
+  return false;
+}
+
+// Removes files in dir which belong to containers that no longer exist.
+// nameOf finds the container name in a file, setting its length.
+void removeStale(struct Flags flags, char *dir, char *known,
+                 char *(*nameOf)(char *path, char *file, size_t *len)) {
+  DIR *entries = opendir(dir);
+  if (!entries) {
+    return;
+  }
+
+  for (struct dirent *entry; (entry = readdir(entries));) {
+    if (*entry->d_name == '.') {
+      continue;
+    }
+
+    char *path = concat(dir, "/", entry->d_name, (char *)0);
+    size_t len;
+    char *name = nameOf(path, entry->d_name, &len);
+    if (name && !isKnownContainer(known, name, len)) {
+      if (flags.dryRun) {
+        printf("rm %s\n", path);
+      } else if (unlink(path)) {
+        fprintf(stderr, "Warning: Failed to remove %s.\n", path);
+      }
+    }
+    free(name);
+    free(path);
+  }
+  closedir(entries);
+}
+
+// Stamps are named after their container
+char *stampContainer(char *path, char *file, size_t *len) {
+  (void)path;
+  *len = strlen(file);
+  return concat(file, (char *)0);
+}
+
+// Logs are NAME.log
+char *logContainer(char *path, char *file, size_t *len) {
+  (void)path;
+  size_t fileLen = strlen(file);
+  if (fileLen < 4 || strcmp(file + fileLen - 4, ".log")) {
+    return 0;
+  }
+  *len = fileLen - 4;
+  return concat(file, (char *)0);
+}
+
+// Desktop entries made by export run "dizzybox enter NAME ..."
+char *desktopEntryContainer(char *path, char *file, size_t *len) {
+  if (strncmp(file, "dizzybox-", 9)) {
+    return 0;
+  }
+
+  FILE *entry = fopen(path, "r");
+  if (!entry) {
+    return 0;
+  }
+  char line[4096];
+  char *name = 0;
+  while (!name && fgets(line, sizeof(line), entry)) {
+    char *command = strstr(line, "dizzybox enter ");
+    if (!strncmp(line, "Exec", 4) && command) {
+      command += sizeof("dizzybox enter ") - 1;
+      *len = strcspn(command, " \n");
+      name = concat(command, (char *)0);
+    }
+  }
+  fclose(entry);
+  return name;
+}
+
+// Removes images made by dizzybox from archives, and untagged images left by
+// removed containers, once no container uses them. Images from registries
+// are kept.
+void removeUnusedImages(struct Flags flags,
+                        const struct ManagedContainer *containers, int count,
+                        const struct ManagedImage *images, int imageCount) {
+  size_t cap = MANAGED_MAX * 1024;
+  char *candidates = checkedMalloc(cap), *used = checkedMalloc(cap);
+  char *imagesArgv[] = {flags.manager, "images",
+                        "--no-trunc",  "--filter",
+                        "reference=localhost/dizzybox-*",
+                        "--format",    "{{.ID}}",
+                        0};
+  char *psArgv[] = {flags.manager, "ps", "--all", "--format",
+                    "{{.Names}}\t{{.ImageID}}", 0};
+  if (captureCommand(imagesArgv, candidates, cap) ||
+      captureCommand(psArgv, used, cap)) {
+    fputs("Warning: Failed to list images, so none were removed.\n", stderr);
+    free(used);
+    free(candidates);
+    return;
+  }
+
+  for (int i = 0; i < imageCount; ++i) {
+    size_t len = strlen(candidates);
+    if (!images[i].kept && images[i].removable &&
+        !strstr(candidates, images[i].id) &&
+        len + strlen(images[i].id) + 2 < cap) {
+      snprintf(candidates + len, cap - len, "%s\n", images[i].id);
+    }
+  }
+
+  char *idEnd;
+  for (char *id = strtok_r(candidates, "\n", &idEnd); id;
+       id = strtok_r(0, "\n", &idEnd)) {
+    if (!strncmp(id, "sha256:", 7)) {
+      id += 7;
+    }
+
+    // Containers being removed still show up on a dry run
+    bool inUse = false;
+    for (char *line = used; *line && !inUse;) {
+      size_t lineLen = strcspn(line, "\n");
+      char *tab = memchr(line, '\t', lineLen);
+      if (tab && (size_t)(line + lineLen - tab - 1) == strlen(id) &&
+          !strncmp(tab + 1, id, strlen(id))) {
+        inUse = true;
+        for (int c = 0; c < count; ++c) {
+          if (containers[c].remove &&
+              strlen(containers[c].name) == (size_t)(tab - line) &&
+              !strncmp(containers[c].name, line, tab - line)) {
+            inUse = false;
+          }
+        }
+      }
+      line += lineLen + !!line[lineLen];
+    }
+    if (inUse) {
+      continue;
+    }
+
+    // Forced, since loaded images also have the tag from their archive
+    char *argv[] = {flags.manager, "rmi", "--force", id, 0};
+    char ignored[256];
+    if (flags.dryRun) {
+      printCommand(argv);
+    } else {
+      captureCommand(argv, ignored, sizeof(ignored));
+    }
+  }
+  free(used);
+  free(candidates);
+}
+
+// Removes containers made by dizzybox according to the policies, then the
+// images and state they leave behind.
+int garbageCollect(struct Flags flags) {
+  if (needsUnshare()) {
+    return unshareSelf(flags, "gc");
+  }
+
+  char *output;
+  struct ManagedContainer containers[MANAGED_MAX];
+  struct ManagedImage images[MANAGED_MAX];
+  int imageCount;
+  int count =
+      managedContainers(flags, &output, containers, images, &imageCount);
+  if (count == -1) {
+    free(output);
+    return EX_UNAVAILABLE;
+  }
+
+  // Running containers are always kept.
+  time_t now = time(0);
+  unsigned long long total = 0, freed = 0;
+  for (int i = 0; i < count; ++i) {
+    total += containers[i].size;
+  }
+  for (int i = 0; i < imageCount; ++i) {
+    total += images[i].size;
+  }
+  for (int i = 0; i < count; ++i) {
+    struct ManagedContainer *container = containers + i;
+    container->remove =
+        !container->running &&
+        ((flags.maxAgeDays >= 0 &&
+          container->created < now - (time_t)flags.maxAgeDays * 86400) ||
+         (flags.idleDays >= 0 &&
+          lastUsed(container) < now - (time_t)flags.idleDays * 86400));
+    if (container->remove) {
+      freed += releaseContainer(container, images, imageCount);
+    }
+  }
+
+  // Then the least recently used ones, until everything fits. Running
+  // containers and the images gc keeps can't be freed, so if they alone
+  // take more than --max-size, no stopped container is removed for it.
+  bool fits = true;
+  if (flags.maxSize) {
+    struct ManagedImage remaining[MANAGED_MAX];
+    memcpy(remaining, images, imageCount * sizeof(*images));
+    unsigned long long freeable = freed;
+    for (int i = 0; i < count; ++i) {
+      if (!containers[i].remove && !containers[i].running) {
+        freeable += releaseContainer(containers + i, remaining, imageCount);
+      }
+    }
+    fits = total - freeable <= flags.maxSize;
+    if (!fits) {
+      fputs("Warning: Running containers and kept images take more than "
+            "--max-size.\n",
+            stderr);
+    }
+  }
+  while (flags.maxSize && fits && total - freed > flags.maxSize) {
+    struct ManagedContainer *oldest = 0;
+    for (int i = 0; i < count; ++i) {
+      if (!containers[i].remove && !containers[i].running &&
+          (!oldest || lastUsed(containers + i) < lastUsed(oldest))) {
+        oldest = containers + i;
+      }
+    }
+    if (!oldest) {
+      break;
+    }
+    oldest->remove = true;
+    freed += releaseContainer(oldest, images, imageCount);
+  }
+
+  char **commands[MANAGED_MAX];
+  char *commandArgv[MANAGED_MAX][4];
+  int removing = 0;
+  for (int i = 0; i < count; ++i) {
+    if (containers[i].remove) {
+      commandArgv[removing][0] = flags.manager;
+      commandArgv[removing][1] = "rm";
+      commandArgv[removing][2] = containers[i].name;
+      commandArgv[removing][3] = 0;
+      commands[removing] = commandArgv[removing];
+      ++removing;
+    }
+  }
+  int exitCode = 0;
+  if (runParallel(flags, commands, removing)) {
+    fputs("Warning: Some containers could not be removed.\n", stderr);
+    exitCode = EX_TEMPFAIL;
+  }
+
+  removeUnusedImages(flags, containers, count, images, imageCount);
+
+  if (removing) {
+    printf("Removed %d containers, freeing %.1f MiB.\n", removing,
+           freed / 1048576.0);
+  }
+  free(output);
+
+  // Only clean up after containers which are known to be gone.
+  char *known = knownContainers(flags);
+  if (!known) {
+    fputs("Warning: Could not list containers, so no state was removed.\n",
+          stderr);
+    return exitCode ? exitCode : EX_UNAVAILABLE;
+  }
+
+  char *applications = concat(userHome(), "/.local/share/applications",
+                              (char *)0);
+  removeStale(flags, applications, known, desktopEntryContainer);
+  free(applications);
+  char *stamps = dataPath("stamps");
+  removeStale(flags, stamps, known, stampContainer);
+  free(stamps);
+  char *logs = logPath("");
+  if (logs) {
+    *strrchr(logs, '/') = 0;
+    removeStale(flags, logs, known, logContainer);
+    free(logs);
+  }
+
+  free(known);
+  return exitCode;
+}
+
+// Returns the path of a systemd user unit for a container.
+// Returned pointer must be freed
+char *autostartUnitPath(char *container, char *suffix) {
+  char *configHome = getenv("XDG_CONFIG_HOME");
+  if (configHome && *configHome) {
+    return concat(configHome, "/systemd/user/dizzybox-", container, suffix,
+                  (char *)0);
   }
 
   struct passwd *pwuid = getpwuid(getuid());
   if (!pwuid) {
-    fputs("Could not find you\n", stderr);
-    return EX_NOUSER;
+    fputs("Failed to get user home information.\n", stderr);
+    exit(EX_CONFIG);
   }
-  char *home = pwuid->pw_dir;
-  int homeLen = strlen(home);
-  if (home[homeLen - 1] == '/') {
-    --homeLen;
+  return concat(pwuid->pw_dir, "/.config/systemd/user/dizzybox-", container,
+                suffix, (char *)0);
+}
+
+// Opens a unit file for writing, or stdout on a dry run.
+FILE *autostartOpenUnit(struct Flags flags, char *path) {
+  if (flags.dryRun) {
+    printf("# %s\n", path);
+    return stdout;
   }
 
-  FILE *sourceFile = fopen(fileName, "r");
-  if (!sourceFile) {
-    fprintf(stderr, "Failed to open %s for reading.\n", fileName);
-    return EX_DATAERR;
+  FILE *file = fopen(path, "w");
+  if (!file) {
+    fprintf(stderr, "Failed to create %s.\n", path);
   }
+  return file;
+}
 
-  FILE *destinationFile; // File to write to
-  if (flags.dryRun) {
-    destinationFile = stdout;
-  } else {
-    // destPath = `${home}/.local/share/applications/dizzybox-${baseName}`
-    const char relBaseName[] = "/.local/share/applications/dizzybox-";
-    int baseLen = strlen(baseName);
-    char *destPath = malloc(homeLen + baseLen + sizeof(relBaseName) +
-                            sizeof("/run/host") - 1);
-    char *pathTail = destPath;
-    memcpy(pathTail, "/run/host", sizeof("/run/host") - 1);
-    memcpy(pathTail += sizeof("/run/host") - 1, home, homeLen);
-    memcpy(pathTail += homeLen, relBaseName, sizeof(relBaseName));
-    strcpy(pathTail += sizeof(relBaseName) - 1, baseName);
+// Generates systemd user units that start the containers in flags.argv,
+// either at login or when their activation socket is first connected to.
+// Each container is started after the one before it.
+int autostart(struct Flags flags) {
+  char *self = selfPath();
+  if (!self) {
+    fputs("Error: Could not determine path to self.\n", stderr);
+    return EX_SOFTWARE;
+  }
 
-    // File is opened in append to avoid clobber
-    destinationFile = fopen(destPath, "a");
-    if (!destinationFile) {
-      fclose(sourceFile);
-      fprintf(stderr, "Destination file %s could not be created.\n", destPath);
-      free(destPath);
-      return EX_CANTCREAT;
-    }
+  // systemctl --user enable [--now] UNITS...
+  char **enableArgv = checkedMalloc(sizeof(char *) * (flags.argc + 5));
+  int enableArgc = 0;
+  enableArgv[enableArgc++] = "systemctl";
+  enableArgv[enableArgc++] = "--user";
+  enableArgv[enableArgc++] = "enable";
+  if (flags.socketActivation) {
+    enableArgv[enableArgc++] = "--now";
+  }
 
-    // Verify that we are writing to an empty file
-    struct stat destInfo;
-    if (fstat(fileno(destinationFile), &destInfo)) {
-      fclose(sourceFile);
-      fclose(destinationFile);
-      fprintf(stderr, "Failed to retrieve the file information for %s.\n",
-              destPath);
-      free(destPath);
-      return EX_DATAERR;
-    };
+  int exitCode = 0;
+  char *after = flags.after;
+  for (int i = 0; i < flags.argc && !exitCode; ++i) {
+    char *container = flags.argv[i];
+    char *servicePath = autostartUnitPath(container, ".service");
+    char *socketPath = autostartUnitPath(container, ".socket");
 
-    if (destInfo.st_size) {
-      fclose(sourceFile);
-      fclose(destinationFile);
-      fprintf(stderr, "Refusing to clobber non-empty file %s.\n", destPath);
-      free(destPath);
-      return EX_DATAERR;
+    if (flags.removeUnits) {
+      char *suffixes[] = {".socket", ".service"};
+      for (int s = 0; s < 2; ++s) {
+        char *name = concat("dizzybox-", container, suffixes[s], (char *)0);
+        char *disableArgv[] = {"systemctl", "--user", "disable", "--now",
+                               name,        0};
+        runCommand(flags, disableArgv);
+        free(name);
+      }
+      char *rmArgv[] = {"rm", "-f", servicePath, socketPath, 0};
+      exitCode = runCommand(flags, rmArgv);
+      goto next;
     }
-  }
 
-  enum {
-    stateStartLine,
-    stateWriting,
-    stateDiscard,
-    stateE,
-    stateEx,
-    stateExe,
-    stateExec,
-    stateExecWhitespace,
-    stateT,
-    stateTr,
-    stateTry,
-    stateTryE,
-    stateTryEx,
-    stateTryExe,
-    stateTryExec,
-  } state = stateStartLine;
-  static char const *const tryExecStr = "TryExec";
-  static char const *const execStr = "Exec";
-  for (;;) {
-    int next = fgetc(sourceFile);
-    if (next == EOF) {
-      break;
+    char *dir = concat(servicePath, (char *)0);
+    *strrchr(dir, '/') = 0;
+    exitCode = flags.dryRun ? 0 : makeDirs(dir);
+    free(dir);
+    if (exitCode) {
+      goto next;
     }
-    // TODO: Add error checking to writes
-    switch (state) {
-    case stateStartLine:
-      if (next == 'E') {
-        state = stateE;
-        break;
-      }
-      if (next == 'T') {
-        state = stateT;
-        break;
-      }
-      state = stateWriting;
-      // Fallthrough
-    case stateWriting:
-      fputc(next, destinationFile);
-      if (next == '\n') {
-        state = stateStartLine;
-      }
-      break;
-    case stateDiscard:
-      if (next == '\n') {
-        fputc(next, destinationFile);
-        state = stateStartLine;
-      }
-      break;
-    case stateE:
-    case stateEx:
-    case stateExe:
-      if (next == execStr[++state - stateE]) {
-        break;
-      }
-      {
-        char const *const end = execStr + state - stateE;
-        for (char const *p = execStr; p < end; ++p)
-          fputc(*p, destinationFile);
-      }
-      fputc(next, destinationFile);
-      state = next == '\n' ? stateStartLine : stateWriting;
-      break;
-    case stateExec:
-      fputs(execStr, destinationFile);
-      state = stateExecWhitespace;
-      // Fallthrough
-    case stateExecWhitespace:
-      fputc(next, destinationFile);
-      if (next == ' ') {
-        break;
-      }
-      if (next == '=') {
-        fputs("dizzybox enter ", destinationFile);
-        // Podman's rules are strict enough to not need escaping.
-        fputs(containerId, destinationFile);
-        fputc(' ', destinationFile);
-        if (flags.shell) {
-          fputs("/usr/bin/entrypoint -l -c 'exec \"$@\"' -- ", destinationFile);
-        }
-        state = stateWriting;
-        break;
-      }
-      if (next == '\n') {
-        state = stateStartLine;
-      } else {
-        state = stateWriting;
-      }
-      break;
-    case stateT:
-    case stateTr:
-    case stateTry:
-    case stateTryE:
-    case stateTryEx:
-    case stateTryExe:
-      if (next == tryExecStr[++state - stateT]) {
-        break;
-      }
-      {
-        char const *const end = tryExecStr + state - stateT;
-        for (char const *p = tryExecStr; p < end; ++p)
-          fputc(*p, destinationFile);
+
+    FILE *service = autostartOpenUnit(flags, servicePath);
+    if (!service) {
+      exitCode = EX_CANTCREAT;
+      goto next;
+    }
+    fprintf(service, "[Unit]\nDescription=dizzybox container %s\n",
+            container);
+    if (after) {
+      fprintf(service, "After=dizzybox-%s.service\n", after);
+    }
+    // The container inherits the priority, so it stays low for daemons
+    // started by /etc/init.sh as well. When socket activated, the service
+    // must become inactive again after accepting the waiting connections,
+    // so that systemd listens again and starts it for the next ones. Going
+    // inactive kills what is left in its cgroup, which includes the
+    // container unless podman moved it to a scope of its own.
+    fprintf(service,
+            "\n[Service]\nType=oneshot\nRemainAfterExit=%s\n"
+            "ExecStart=\"%s\" start %s\n",
+            flags.socketActivation ? "no" : "yes", self, container);
+    if (flags.socketActivation) {
+      fputs("KillMode=process\n", service);
+    } else {
+      fputs("Nice=19\nIOSchedulingClass=idle\n"
+            "\n[Install]\nWantedBy=default.target\n",
+            service);
+    }
+    if (service != stdout && fclose(service)) {
+      exitCode = EX_IOERR;
+      goto next;
+    }
+
+    if (flags.socketActivation) {
+      FILE *socket = autostartOpenUnit(flags, socketPath);
+      if (!socket) {
+        exitCode = EX_CANTCREAT;
+        goto next;
       }
-      fputc(next, destinationFile);
-      state = next == '\n' ? stateStartLine : stateWriting;
-      break;
-    case stateTryExec:
-      if (next == ' ' || next == '=') {
-        state = stateDiscard;
-        break;
+      fprintf(socket,
+              "[Unit]\nDescription=Activation socket for dizzybox container "
+              "%s\n\n[Socket]\nListenStream=%%t/dizzybox/activate/%s.sock\n"
+              "\n[Install]\nWantedBy=sockets.target\n",
+              container, container);
+      if (socket != stdout && fclose(socket)) {
+        exitCode = EX_IOERR;
+        goto next;
       }
-      fputs(tryExecStr, destinationFile);
-      state = stateWriting;
-      break;
     }
+
+    enableArgv[enableArgc++] =
+        concat("dizzybox-", container,
+               flags.socketActivation ? ".socket" : ".service", (char *)0);
+    after = container;
+
+  next:
+    free(socketPath);
+    free(servicePath);
   }
+  enableArgv[enableArgc] = 0;
 
-  int err = ferror(sourceFile);
-  fclose(destinationFile);
-  fclose(sourceFile);
-  if (err) {
-    fputs("Warning: Potentially partial write", stderr);
-    return EX_DATAERR;
+  char *reloadArgv[] = {"systemctl", "--user", "daemon-reload", 0};
+  if (!exitCode) {
+    exitCode = runCommand(flags, reloadArgv);
   }
-  return 0;
+  if (!exitCode && !flags.removeUnits) {
+    exitCode = runCommand(flags, enableArgv);
+  }
+
+  for (int i = flags.socketActivation ? 4 : 3; i < enableArgc; ++i) {
+    free(enableArgv[i]);
+  }
+  free(enableArgv);
+  free(self);
+  return exitCode;
 }
 
-int export(struct Flags flags) {
-  int result;
-  char **end = flags.argv + flags.argc;
-  for (char **p = flags.argv; p < end; p++) {
-    if ((result = exportDesktopEntry(flags, *p))) {
-      return result;
-    }
+// When started through an activation socket, accepts the connections that
+// are waiting on it, letting the clients know that the container is up.
+void autostartAcceptPending(void) {
+  char *listenPid = getenv("LISTEN_PID");
+  char *listenFds = getenv("LISTEN_FDS");
+  if (!listenPid || !listenFds || atoi(listenPid) != getpid() ||
+      atoi(listenFds) < 1) {
+    return;
   }
-  return 0;
+
+  // Passed sockets start after stderr
+  int listener = STDERR_FILENO + 1;
+  fcntl(listener, F_SETFL, fcntl(listener, F_GETFL) | O_NONBLOCK);
+  for (int client; (client = accept(listener, 0, 0)) != -1;) {
+    close(client);
+  }
+  close(listener);
 }
 
-// Signal handler that exits the program.
+// Set when the container has been restored from a checkpoint.
+static volatile sig_atomic_t entrypointRestored = 0;
+
+// Signal handler that exits the program, or notes a restore on SIGUSR2.
 void entrypointSignalHandler(int signal) {
-  (void)signal; // mark as unused
-  exit(0);
+  if (signal == SIGUSR2) {
+    entrypointRestored = 1;
+    return;
+  }
+  _exit(0);
+}
+
+// Starts a hook script in the background if it exists.
+// Returns -1 if it exists but could not be started.
+int entrypointRunHook(char *path) {
+  // Note: Race condition
+  if (access(path, X_OK)) {
+    return 0;
+  }
+
+  // Output is logged with the name of the hook as the tag
+  char *name = strrchr(path, '/') + 1;
+  char errorsTag[32];
+  snprintf(errorsTag, sizeof(errorsTag), "%s[stderr]", name);
+  int output = logCapture(name);
+  int errors = output == -1 ? -1 : logCapture(errorsTag);
+  if (output != -1 && errors == -1) {
+    close(output);
+    output = -1;
+  }
+  logWrite("entrypoint", path, strlen(path));
+
+  int childPid = fork();
+  if (childPid && output != -1) {
+    close(output);
+    close(errors);
+  }
+  if (childPid == -1) {
+    fputs("Failed to fork.\n", stderr);
+    return -1;
+  }
+
+  if (!childPid) {
+    sigset_t none;
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, 0);
+
+    if (output != -1) {
+      dup2(output, STDOUT_FILENO);
+      dup2(errors, STDERR_FILENO);
+    }
+
+    char *argv[] = {path, 0};
+    execvp(argv[0], argv);
+
+    fprintf(stderr, "Warning: %s failed to start.\n", path);
+    exit(EX_OSERR);
+  }
+  return 0;
 }
 
 // This handles being run as /usr/bin/entrypoint.
@@ -763,6 +4393,10 @@ int entrypoint(int argc, char *argv[]) {
 
   // If we are not init, entrypoint exec the user's default shell.
   if (getpid() != 1) {
+    if (getenv("DIZZYBOX_SESSION")) {
+      return sessionCreate(argv + 1);
+    }
+
     // Note to self: Do not free pwuid!
     struct passwd *pwuid = getpwuid(getuid());
 
@@ -785,31 +4419,49 @@ int entrypoint(int argc, char *argv[]) {
     return EX_OSERR;
   }
 
-  // Otherwise, we are the init. Launch init.sh if it exists.
-  // Note: Race condition
-  if (!access("/etc/init.sh", X_OK)) {
-    int childPid = fork();
-    if (childPid == -1) {
-      fputs("Failed to fork.\n", stderr);
-      exit(EX_OSERR);
+  // Otherwise, we are the init. Output of hooks goes to the log if one was
+  // set up when creating the container.
+  char *log = getenv("DIZZYBOX_LOG");
+  if (log) {
+    char *dir = concat(log, (char *)0);
+    *strrchr(dir, '/') = 0;
+    if (makeDirs(dir) || !(entrypointLog = logOpen(log, true))) {
+      fprintf(stderr, "Warning: Failed to open the log %s.\n", log);
     }
 
-    if (!childPid) {
-      char *argv[] = {"/etc/init.sh", 0};
-      execvp(argv[0], argv);
-
-      fputs("Warning: /etc/init.sh failed to start.\n", stderr);
-      exit(EX_OSERR);
+    // Hand what was created to the owner of XDG_RUNTIME_DIR, since root in
+    // the container may be someone else on the host.
+    char *dizzyboxDir = concat(dir, (char *)0);
+    *strrchr(dizzyboxDir, '/') = 0;
+    char *runtimeDir = concat(dizzyboxDir, (char *)0);
+    *strrchr(runtimeDir, '/') = 0;
+    struct stat owner;
+    if (!stat(runtimeDir, &owner)) {
+      char *created[] = {dizzyboxDir, dir, log};
+      // Failing only stops the owner from removing them
+      for (size_t i = 0; i < sizeof(created) / sizeof(*created); ++i) {
+        (void)!lchown(created[i], owner.st_uid, owner.st_gid);
+      }
     }
-  };
+    free(runtimeDir);
+    free(dizzyboxDir);
+    free(dir);
+    unsetenv("DIZZYBOX_LOG");
+  }
+
+  // Launch init.sh if it exists.
+  if (entrypointRunHook("/etc/init.sh")) {
+    exit(EX_OSERR);
+  }
 
-  // Handle SIGTERM
+  // Handle SIGTERM, and SIGUSR2 which is sent after restoring a checkpoint
   struct sigaction termHandler = {
       .sa_handler = entrypointSignalHandler,
       .sa_flags = 0,
   };
   sigfillset(&termHandler.sa_mask);
   sigaction(SIGTERM, &termHandler, 0);
+  sigaction(SIGUSR2, &termHandler, 0);
 
   // Disable creation of zombies
   struct sigaction childHandler = {
@@ -818,9 +4470,24 @@ int entrypoint(int argc, char *argv[]) {
   };
   sigaction(SIGCHLD, &childHandler, 0);
 
-  // Sleep forever
+  // Sessions started by dizzybox enter --attach are held here
+  mkdir("/run/dizzybox", 0755);
+  int sessionControl = sessionListen(SESSION_CONTROL, 0666);
+
+  // Serve forever. SIGUSR2 is only let through while waiting so that it
+  // cannot arrive between checking for it and going back to sleep.
+  sigset_t restoreSignal, waitMask;
+  sigemptyset(&restoreSignal);
+  sigaddset(&restoreSignal, SIGUSR2);
+  sigprocmask(SIG_BLOCK, &restoreSignal, &waitMask);
+  sigdelset(&waitMask, SIGUSR2);
   for (;;) {
-    pause();
+    entrypointServe(sessionControl, &waitMask);
+    if (entrypointRestored) {
+      // Daemons may need to reconnect to things outside of the container.
+      entrypointRestored = 0;
+      entrypointRunHook("/etc/restore.sh");
+    }
   }
 }
 
@@ -831,12 +4498,30 @@ int main(int argc, char *argv[]) {
     return err;
   }
 
+  // Existing containers remember which OCI runtime they were created with.
+  switch (flags.subcommand) {
+  case subcommandStart:
+  case subcommandEnter:
+  case subcommandRemove:
+  case subcommandSuspend:
+  case subcommandResume:
+  case subcommandUpgrade:
+    if (!flags.runtime) {
+      flags.runtime = ociRuntime(flags.container);
+    }
+    break;
+  default:
+    break;
+  }
+
   switch (flags.subcommand) {
   case subcommandHelp:
     printHelp(argv[0]);
     break;
   case subcommandStart:
-    return containerStart(flags);
+    err = containerStart(flags);
+    autostartAcceptPending();
+    return err;
   case subcommandEnter:
     return containerEnter(flags);
   case subcommandCreate:
@@ -847,6 +4532,20 @@ int main(int argc, char *argv[]) {
     return installEntrypoint(flags);
   case subcommandExport:
     return export(flags);
+  case subcommandCache:
+    return cacheCommand(flags);
+  case subcommandDiskUsage:
+    return diskUsage(flags);
+  case subcommandGarbageCollect:
+    return garbageCollect(flags);
+  case subcommandAutostart:
+    return autostart(flags);
+  case subcommandSuspend:
+    return containerSuspend(flags);
+  case subcommandResume:
+    return containerResume(flags);
+  case subcommandLogs:
+    return logsCommand(flags);
   case subcommandEntrypoint:
     return entrypoint(argc, argv);
   }